@@ -37,6 +37,8 @@
 #include <current.h>
 #include <syscall.h>
 #include <proc.h>
+#include <scratch.h>
+#include <copyinout.h>
 /*
  * System call dispatcher.
  *
@@ -82,6 +84,9 @@ void syscall(struct trapframe *tf)
 	int32_t retval_low = 0;
 	int32_t retval_up = 0;
 	int err = 0;
+#if OPT_FILESYSTEM
+	off_t pos;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -159,6 +164,43 @@ void syscall(struct trapframe *tf)
 	case SYS_close:
 		retval = sys_close((int)tf->tf_a0);
 		break;
+	case SYS_pipe:
+		err = sys_pipe((userptr_t)tf->tf_a0, &retval);
+		break;
+	case SYS_pread:
+	case SYS_pwrite:
+		//fd, buf e size occupano a0-a2; l'offset a 64 bit va in una
+		//coppia allineata di registri, che non c'è più, quindi sta
+		//sullo stack utente a sp+16
+		err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+		if (err) {
+			break;
+		}
+		if (callno == SYS_pread) {
+			err = sys_pread((int)tf->tf_a0,
+							(userptr_t)tf->tf_a1,
+							(size_t)tf->tf_a2,
+							pos, &retval);
+		}
+		else {
+			err = sys_pwrite((int)tf->tf_a0,
+							 (userptr_t)tf->tf_a1,
+							 (size_t)tf->tf_a2,
+							 pos, &retval);
+		}
+		break;
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0,
+						(userptr_t)tf->tf_a1,
+						(int)tf->tf_a2,
+						&retval);
+		break;
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0,
+						 (userptr_t)tf->tf_a1,
+						 (int)tf->tf_a2,
+						 &retval);
+		break;
 #endif
 
 #if OPT_SHELL
@@ -195,6 +237,12 @@ void syscall(struct trapframe *tf)
 		err = sys__getcwd((char *)tf->tf_a0, (size_t)tf->tf_a1, &retval);
 		break;
 
+	case SYS_getdirentries:
+		err = sys_getdirentries((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+					(size_t)tf->tf_a2, (userptr_t)tf->tf_a3,
+					&retval);
+		break;
+
 	case SYS_execv:
 		retval = sys_execv((char *)tf->tf_a0, (char **)tf->tf_a1);
 		break;
@@ -209,6 +257,9 @@ void syscall(struct trapframe *tf)
 		break;
 	}
 
+	/* Drop any temporaries the call took from the scratch arena. */
+	scratch_reset();
+
 	if (err)
 	{
 		/*
@@ -246,6 +246,8 @@ con_io(struct device *dev, struct uio *uio)
 {
 	int result;
 	char ch;
+	char buf[64];
+	size_t len, i;
 	struct lock *lk;
 
 	(void)dev;  // unused
@@ -276,15 +278,27 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			/*
+			 * Pull the data over in chunks rather than a
+			 * byte at a time, so that writes (especially
+			 * of several iovecs) from userspace don't pay
+			 * for a copyin per character.
+			 */
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
+			for (i=0; i<len; i++) {
+				if (buf[i]=='\n') {
+					putch('\r');
+				}
+				putch(buf[i]);
 			}
-			putch(ch);
 		}
 	}
 	lock_release(lk);
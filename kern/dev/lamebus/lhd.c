@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +96,180 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * Requests wait on lh_queue sorted by starting sector and are served
+ * in C-LOOK order: next is the first one at or past the sector the
+ * head is on, and once there are none the head goes back to the
+ * lowest. A request that starts right where a queued one in the same
+ * direction ends, or ends right where it starts, is merged into it
+ * (up to LHD_MAXMERGE sectors) so the two go out back to back: the
+ * merged bios hang off the first one through bio_chain.
+ *
+ * The card does one sector at a time. The interrupt handler moves
+ * the data for the sector just done, starts the next one, and calls
+ * bio_done when a bio is finished. Everything here is done with
+ * lh_qlock held.
+ */
+#define LHD_MAXMERGE	128
+
+/*
+ * Start the current sector of the request in progress.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct bio *bio = lh->lh_curbio;
+	uint32_t statval = LHD_WORKING;
+
+	if (bio->bio_write) {
+		memcpy(lh->lh_buf,
+		       (char *)bio->bio_data + lh->lh_cursect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, bio->bio_block + lh->lh_cursect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * The device is idle; pick the next request, C-LOOK style, and
+ * start it.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct bio **bp, *bio;
+
+	KASSERT(lh->lh_curbio == NULL);
+
+	bp = &lh->lh_queue;
+	while (*bp != NULL && (*bp)->bio_block < lh->lh_headpos) {
+		bp = &(*bp)->bio_next;
+	}
+	if (*bp == NULL) {
+		/* Nothing further along; go back to the start. */
+		bp = &lh->lh_queue;
+	}
+	bio = *bp;
+	if (bio == NULL) {
+		return;
+	}
+	*bp = bio->bio_next;
+	bio->bio_next = NULL;
+
+	lh->lh_curbio = bio;
+	lh->lh_cursect = 0;
+	lhd_startsect(lh);
+}
+
+/*
+ * Put BIO (with its chain) on the queue in sector order.
+ */
+static
+void
+lhd_insert(struct lhd_softc *lh, struct bio *bio)
+{
+	struct bio **bp;
+
+	bp = &lh->lh_queue;
+	while (*bp != NULL && (*bp)->bio_block <= bio->bio_block) {
+		bp = &(*bp)->bio_next;
+	}
+	bio->bio_next = *bp;
+	*bp = bio;
+}
+
+/*
+ * Try to merge BIO into a queued request. Returns true if it was.
+ */
+static
+bool
+lhd_merge(struct lhd_softc *lh, struct bio *bio)
+{
+	struct bio **bp, *req;
+	uint32_t end;
+
+	for (bp = &lh->lh_queue; (req = *bp) != NULL; bp = &req->bio_next) {
+		if (req->bio_write != bio->bio_write) {
+			continue;
+		}
+		end = req->bio_chaintail->bio_block +
+			req->bio_chaintail->bio_nblocks;
+		if (end - req->bio_block + bio->bio_nblocks > LHD_MAXMERGE) {
+			continue;
+		}
+		if (end == bio->bio_block) {
+			/* Goes on the end */
+			req->bio_chaintail->bio_chain = bio;
+			req->bio_chaintail = bio;
+			return true;
+		}
+		if (bio->bio_block + bio->bio_nblocks == req->bio_block) {
+			/* Goes in front, and takes over req's place */
+			*bp = req->bio_next;
+			req->bio_next = NULL;
+			bio->bio_chain = req;
+			bio->bio_chaintail = req->bio_chaintail;
+			lhd_insert(lh, bio);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Record that the sector in progress has completed: copy out the data
+ * if it was a read, and go on to the next sector, bio, or request.
+ * A bio that is done, successfully or not, is handed back through its
+ * callback once the queue lock has been dropped.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct bio *bio, *done = NULL;
+
+	spinlock_acquire(&lh->lh_qlock);
+
+	bio = lh->lh_curbio;
+	KASSERT(bio != NULL);
+
+	if (err == 0 && !bio->bio_write) {
+		membar_load_load();
+		memcpy((char *)bio->bio_data + lh->lh_cursect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_headpos = bio->bio_block + lh->lh_cursect + 1;
+	lh->lh_cursect++;
+
+	if (err != 0 || lh->lh_cursect == bio->bio_nblocks) {
+		bio->bio_error = err;
+		lh->lh_curbio = bio->bio_chain;
+		lh->lh_cursect = 0;
+		bio->bio_chain = NULL;
+		done = bio;
+	}
+
+	if (lh->lh_curbio != NULL) {
+		lhd_startsect(lh);
+	}
+	else {
+		lhd_startnext(lh);
+	}
+
+	spinlock_release(&lh->lh_qlock);
+
+	if (done != NULL) {
+		done->bio_done(done);
+	}
 }
 
 /*
@@ -179,8 +344,50 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a block I/O request.
+ */
+static
+int
+lhd_strategy(struct device *d, struct bio *bio)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (bio->bio_nblocks == 0 ||
+	    bio->bio_block >= lh->lh_dev.d_blocks ||
+	    bio->bio_nblocks > lh->lh_dev.d_blocks - bio->bio_block) {
+		return EINVAL;
+	}
+
+	bio->bio_error = 0;
+	bio->bio_next = NULL;
+	bio->bio_chain = NULL;
+	bio->bio_chaintail = bio;
+
+	spinlock_acquire(&lh->lh_qlock);
+	if (!lhd_merge(lh, bio)) {
+		lhd_insert(lh, bio);
+	}
+	if (lh->lh_curbio == NULL) {
+		lhd_startnext(lh);
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return 0;
+}
+
+/*
+ * Largest transfer lhd_io sends through the queue at once, in sectors.
+ */
+#define LHD_IOSECTS	16
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * This goes through the request queue like everything else, via a
+ * bounce buffer since the uio may point at user memory, which the
+ * interrupt handler can't touch.
  */
 static
 int
@@ -192,9 +399,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	bool write = uio->uio_rw == UIO_WRITE;
+	uint32_t n;
+	void *bounce;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -207,67 +415,51 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	bounce = kmalloc((len < LHD_IOSECTS ? len : LHD_IOSECTS)
+			 * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	while (len > 0) {
+		n = len < LHD_IOSECTS ? len : LHD_IOSECTS;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = bio_io(d, sector, n, bounce, write);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_strategy = lhd_strategy,
 };
 
 /*
@@ -284,17 +476,12 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_queue = NULL;
+	lh->lh_curbio = NULL;
+	lh->lh_cursect = 0;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
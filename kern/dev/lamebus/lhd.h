@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/* Request queue; the lock is also taken by the interrupt handler */
+	struct spinlock lh_qlock;
+	struct bio *lh_queue;		/* waiting requests, by sector */
+	struct bio *lh_curbio;		/* request in progress, or NULL */
+	uint32_t lh_cursect;		/* sector of lh_curbio in progress */
+	uint32_t lh_headpos;		/* sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -33,11 +33,246 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <bitmap.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Routine for doing I/O (reads or writes) on block J of the free
+ * block bitmap. Blocks are read in as they're needed (see
+ * sfs_freemap_load) and written back by sfs_sync only if they're
+ * marked in sfs_freemapdirty.
+ *
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
+ * sectors of bits, one bit for each sector on the filesystem. The
+ * number of blocks in the bitmap is thus rounded up to the nearest
+ * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
+ * This means that the bitmap will (in general) contain space for some
+ * number of invalid sectors that are actually beyond the end of the
+ * disk device. This is ok. These sectors are supposed to be marked
+ * "in use" by mksfs and never get marked "free".
+ *
+ * The sectors used by the superblock and the bitmap itself are
+ * likewise marked in use by mksfs.
+ */
+int
+sfs_freemapio(struct sfs_fs *sfs, uint32_t j, enum uio_rw rw)
+{
+	char *freemapdata;
+	void *ptr;
+
+	/* Pointer to our freemap data in memory. */
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+
+	/* Get a pointer to block J's data */
+	ptr = freemapdata + j*SFS_BLOCKSIZE;
+
+	/* and read or write it. The freemap starts at sector 2. */
+	if (rw == UIO_READ) {
+		return sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
+				     SFS_BLOCKSIZE);
+	}
+	else {
+		return sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
+				      SFS_BLOCKSIZE);
+	}
+}
+
+/*
+ * Count the free blocks covered by freemap block J.
+ */
+static
+unsigned
+sfs_freemap_countfree(struct sfs_fs *sfs, uint32_t j)
+{
+	const unsigned char *p;
+	unsigned i, v, n = 0;
+
+	p = (unsigned char *)bitmap_getdata(sfs->sfs_freemap) +
+		j*SFS_BLOCKSIZE;
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		for (v = ~p[i] & 0xff; v != 0; v &= v - 1) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Make sure freemap block J has been read in. Until then its part of
+ * the in-memory bitmap is all ones, so nothing there looks free, and
+ * all we know about it is its free count. Freemap lock held.
+ */
+static
+int
+sfs_freemap_load(struct sfs_fs *sfs, uint32_t j)
+{
+	unsigned nfree;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (bitmap_isset(sfs->sfs_freemaploaded, j)) {
+		return 0;
+	}
+	result = sfs_freemapio(sfs, j, UIO_READ);
+	if (result) {
+		return result;
+	}
+	bitmap_rescan(sfs->sfs_freemap, j * SFS_BITSPERBLOCK);
+	bitmap_mark(sfs->sfs_freemaploaded, j);
+
+	nfree = sfs_freemap_countfree(sfs, j);
+	if (nfree != sfs->sfs_freecount[j]) {
+		kprintf("sfs: %s: freemap block %u has %u free, "
+			"summary said %u\n", sfs->sfs_sb.sb_volname, j,
+			nfree, sfs->sfs_freecount[j]);
+		sfs->sfs_freecount[j] = nfree;
+	}
+	return 0;
+}
+
+/*
+ * Set up the in-memory freemap at mount time. If the superblock has
+ * a valid summary, only the free counts are loaded now and the
+ * freemap itself is read in a block at a time as it's used, so this
+ * doesn't depend on the size of the volume. Otherwise the whole
+ * freemap is read in and counted.
+ */
+int
+sfs_freemap_setup(struct sfs_fs *sfs)
+{
+	uint32_t j, nfm, nbits;
+	int result;
+
+	nfm = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	nbits = SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks);
+
+	sfs->sfs_freemap = bitmap_create(nbits);
+	sfs->sfs_freemapdirty = bitmap_create(nfm);
+	sfs->sfs_freemaploaded = bitmap_create(nfm);
+	sfs->sfs_freecount = kmalloc(nfm * sizeof(sfs->sfs_freecount[0]));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirty == NULL ||
+	    sfs->sfs_freemaploaded == NULL || sfs->sfs_freecount == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (sfs->sfs_sb.sb_sumvalid != SFS_SUMVALID || nfm > SFS_SUMMAX) {
+		/* No summary to go by */
+		for (j=0; j<nfm; j++) {
+			result = sfs_freemapio(sfs, j, UIO_READ);
+			if (result) {
+				lock_release(sfs->sfs_freemaplock);
+				return result;
+			}
+			bitmap_mark(sfs->sfs_freemaploaded, j);
+			sfs->sfs_freecount[j] = sfs_freemap_countfree(sfs, j);
+		}
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	memset(bitmap_getdata(sfs->sfs_freemap), 0xff, nfm * SFS_BLOCKSIZE);
+	for (j=0; j<nfm; j++) {
+		sfs->sfs_freecount[j] = sfs->sfs_sb.sb_freecount[j];
+	}
+
+	/*
+	 * The summary goes stale with the first allocation; make sure
+	 * it doesn't still look valid on disk if we crash.
+	 */
+	sfs->sfs_sb.sb_sumvalid = 0;
+	result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				sizeof(sfs->sfs_sb));
+	lock_release(sfs->sfs_freemaplock);
+	if (result) {
+		return result;
+	}
+	return buffer_sync(sfs->sfs_device);
+}
+
+/*
+ * Write the free counts into the superblock at unmount time, after
+ * the final sync, so the next mount can use them, and sync that too.
+ * If it doesn't make it out, the volume stays mounted and the counts
+ * go stale, so take the summary back.
+ */
+int
+sfs_freemap_summarize(struct sfs_fs *sfs)
+{
+	uint32_t j, nfm;
+	int result;
+
+	nfm = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	if (nfm > SFS_SUMMAX) {
+		/* Doesn't fit; the next mount reads the whole freemap. */
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (j=0; j<nfm; j++) {
+		sfs->sfs_sb.sb_freecount[j] = sfs->sfs_freecount[j];
+	}
+	sfs->sfs_sb.sb_sumvalid = SFS_SUMVALID;
+	result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				sizeof(sfs->sfs_sb));
+	if (result) {
+		sfs->sfs_sb.sb_sumvalid = 0;
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		/*
+		 * The superblock buffer may still go out later; make
+		 * sure it doesn't go out with the summary in it.
+		 */
+		sfs->sfs_sb.sb_sumvalid = 0;
+		(void)sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				     sizeof(sfs->sfs_sb));
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+/*
+ * Pick the freemap block to allocate from: the one HINT falls in if
+ * it has any free blocks, or else the next one that does, wrapping
+ * around. Full ones are skipped by their free counts without being
+ * read in. Freemap lock held.
+ */
+static
+int
+sfs_freemap_pick(struct sfs_fs *sfs, daddr_t hint, uint32_t *ret)
+{
+	uint32_t j, k, nfm;
+	int result;
+
+	nfm = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	for (k=0; k<nfm; k++) {
+		j = (hint / SFS_BITSPERBLOCK + k) % nfm;
+		if (sfs->sfs_freecount[j] == 0) {
+			continue;
+		}
+		result = sfs_freemap_load(sfs, j);
+		if (result) {
+			return result;
+		}
+		/* Loading it may have corrected the count */
+		if (sfs->sfs_freecount[j] > 0) {
+			*ret = j;
+			return 0;
+		}
+	}
+	return ENOSPC;
+}
+
 /*
  * Zero out a disk block.
  */
@@ -45,35 +280,93 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
+
+	/* No point reading what we're about to overwrite */
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Note that the freemap bit for BLOCK changed, so the block of the
+ * freemap it's in gets written at the next sync. Freemap lock held.
+ */
+static
+void
+sfs_freemap_touch(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned j = block / SFS_BITSPERBLOCK;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	if (!bitmap_isset(sfs->sfs_freemapdirty, j)) {
+		bitmap_mark(sfs->sfs_freemapdirty, j);
+	}
 }
 
 /*
- * Allocate a block.
+ * Allocate a block, preferably at or just after HINT so that the
+ * blocks of a file end up next to each other on disk; failing that,
+ * the next free block after it, wrapping around. A HINT of 0 (the
+ * superblock, never free) means no preference: take the first free
+ * block on the disk.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t hint, daddr_t *diskblock)
 {
+	uint32_t j;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (hint >= sfs->sfs_sb.sb_nblocks) {
+		hint = 0;
+	}
+	result = sfs_freemap_pick(sfs, hint, &j);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	if (j != hint / SFS_BITSPERBLOCK) {
+		/* Nothing free near HINT; start where there is */
+		hint = j * SFS_BITSPERBLOCK;
+	}
+	if (hint == 0) {
+		result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	}
+	else {
+		result = bitmap_alloc_near(sfs->sfs_freemap, hint, diskblock);
+	}
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	j = *diskblock / SFS_BITSPERBLOCK;
+	KASSERT(sfs->sfs_freecount[j] > 0);
+	sfs->sfs_freecount[j]--;
+	sfs_freemap_touch(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
+	/*
+	 * Clear block before returning it. (It's ours now, so this
+	 * needn't be under the freemap lock.)
+	 */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs->sfs_freecount[*diskblock / SFS_BITSPERBLOCK]++;
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
@@ -84,8 +377,30 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	uint32_t j;
+	int result;
+
+	/*
+	 * Don't bother writing out whatever was in it. This has to
+	 * come first: once the bit is clear someone else may allocate
+	 * the block and put fresh data in the cache.
+	 */
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	j = diskblock / SFS_BITSPERBLOCK;
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemap_load(sfs, j);
+	if (result) {
+		/* It stays marked in use; sfsck can get it back. */
+		kprintf("sfs: %s: block %u lost: can't read freemap: %s\n",
+			sfs->sfs_sb.sb_volname, diskblock, strerror(result));
+		lock_release(sfs->sfs_freemaplock);
+		return;
+	}
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs->sfs_freecount[j]++;
+	sfs_freemap_touch(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +409,17 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	/* If it can't be read in, everything there reads as in use. */
+	(void)sfs_freemap_load(sfs, diskblock / SFS_BITSPERBLOCK);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
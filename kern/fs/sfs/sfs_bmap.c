@@ -36,38 +36,115 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Keep a copy of the leaf indirect block IDPTR, which maps the file
+ * blocks from BASE on, so that the next lookups in it don't have to
+ * go to the buffer cache. Sequential access goes through a whole
+ * leaf before moving on. If there's no memory, we just don't cache.
+ */
+static
+void
+sfs_bmap_remember(struct sfs_vnode *sv, uint32_t base, const uint32_t *idptr)
+{
+	if (sv->sv_map == NULL) {
+		sv->sv_map = kmalloc(SFS_BLOCKSIZE);
+		if (sv->sv_map == NULL) {
+			return;
+		}
+	}
+	memcpy(sv->sv_map, idptr, SFS_BLOCKSIZE);
+	sv->sv_mapbase = base;
+	sv->sv_mapvalid = true;
+}
+
+/*
+ * Pick where sfs_balloc should try to put direct block FILEBLOCK of a
+ * file (or, for SFS_NDIRECT, the indirect block): right after the
+ * block before it, or after the inode if there's none.
+ */
+static
+daddr_t
+sfs_bmap_hint(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	KASSERT(fileblock <= SFS_NDIRECT);
+
+	if (fileblock > 0 && sv->sv_i.sfi_direct[fileblock-1] != 0) {
+		return sv->sv_i.sfi_direct[fileblock-1] + 1;
+	}
+	return sv->sv_ino + 1;
+}
+
+/*
+ * Indirect blocks. The inode has one each of single, double and
+ * triple indirect blocks (levels 1, 2 and 3); an indirect block at
+ * level L maps SFS_DBPERIDB^L file blocks, each of its entries
+ * pointing to a level L-1 block, or at level 1 to a data block.
+ */
+#define SFS_IDLEVELS 3
+
+/*
+ * Number of file blocks mapped by one indirect block entry at
+ * LEVEL+1, i.e. SFS_DBPERIDB^LEVEL.
+ */
+static
+uint32_t
+sfs_idspan(unsigned level)
+{
+	uint32_t span = 1;
+
+	while (level-- > 0) {
+		span *= SFS_DBPERIDB;
+	}
+	return span;
+}
+
+/*
+ * Where the inode keeps the number of its LEVEL indirect block.
+ */
+static
+uint32_t *
+sfs_idroot(struct sfs_vnode *sv, unsigned level)
+{
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
+
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: sfs_idroot: bad level %u\n", level);
+	return NULL;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * The caller must hold the vnode's lock.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
+	struct buf *idbuf;
+	uint32_t *idptr, *rootp;
+	daddr_t block, hint;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t origblock = fileblock;
+	uint32_t idoff, span;
+	unsigned level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,14 +159,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, sfs_bmap_hint(sv, fileblock),
+					    &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -105,27 +183,41 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. If it's covered by the last leaf
+	 * indirect block we went through, the answer is in our copy
+	 * of it, unless we need to allocate.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	if (sv->sv_mapvalid && fileblock >= sv->sv_mapbase &&
+	    fileblock - sv->sv_mapbase < SFS_DBPERIDB) {
+		block = sv->sv_map[fileblock - sv->sv_mapbase];
+		if (block != 0 || !doalloc) {
+			*diskblock = block;
+			return 0;
+		}
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Subtract off the number of direct blocks, and then the
+	 * blocks each level of indirection maps, to find out which
+	 * indirect block covers it and where.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
+	fileblock -= SFS_NDIRECT;
+	for (level=1; level<=SFS_IDLEVELS; level++) {
+		span = sfs_idspan(level);
+		if (fileblock < span) {
+			break;
+		}
+		fileblock -= span;
+	}
+
+	/* If the offset we were asked for is too large, fail. */
+	if (level > SFS_IDLEVELS) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	rootp = sfs_idroot(sv, level);
+	idblock = *rootp;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -141,91 +233,183 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
 		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * indirect block. Put it after the last direct block,
+		 * or whatever the previous level ended with.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		hint = (level > 1 && *sfs_idroot(sv, level-1) != 0) ?
+			*sfs_idroot(sv, level-1) + 1 :
+			sfs_bmap_hint(sv, SFS_NDIRECT);
+		result = sfs_balloc(sfs, hint, &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*rootp = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* (sfs_balloc zeroed it, so it's now in the cache) */
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down the levels, one indirect block read per level,
+	 * allocating missing blocks along the way if asked.
+	 */
+	for (; level > 0; level--) {
+		span = sfs_idspan(level-1);
+		idoff = fileblock / span;
+		fileblock %= span;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Load the indirect block */
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		idptr = buffer_map(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the next block out of the indirect block */
+		block = idptr[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			/* Right after the previous one, or this block */
+			hint = (idoff > 0 && idptr[idoff-1] != 0) ?
+				idptr[idoff-1] + 1 : idblock + 1;
+			result = sfs_balloc(sfs, hint, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			idptr[idoff] = block;
+
+			/* The indirect block is now dirty */
+			buffer_mark_dirty(idbuf);
+		}
+		if (level == 1) {
+			sfs_bmap_remember(sv, origblock - idoff, idptr);
+		}
+		buffer_release(idbuf);
+
+		if (block == 0) {
+			/* Hole; nothing further down */
+			break;
 		}
+		idblock = block;
 	}
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
 		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+		      block, origblock, sv->sv_ino);
 	}
 	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks at or past file block BLOCKLEN under the LEVEL
+ * indirect block *IDBLOCKP, which maps the file blocks from BASE on.
+ * If that leaves it empty, free it too and zero *IDBLOCKP.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *idblockp, unsigned level,
+		    uint32_t base, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *idptr;
+	uint32_t span, j, old;
+	bool hasnonzero, iddirty;
+	int result;
+
+	/* File blocks per entry */
+	span = sfs_idspan(level-1);
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptr = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (idptr[j] == 0) {
+			continue;
+		}
+		if (level == 1) {
+			/* Discard any blocks that are past the new EOF */
+			if (base + j >= blocklen) {
+				sfs_bfree(sfs, idptr[j]);
+				idptr[j] = 0;
+				iddirty = true;
+			}
+		}
+		else if (base + (j+1) * span > blocklen) {
+			/* Some of what this entry maps is past the new EOF */
+			old = idptr[j];
+			result = sfs_itrunc_indirect(sfs, &idptr[j], level-1,
+						     base + j * span, blocklen);
+			if (idptr[j] != old) {
+				iddirty = true;
+			}
+			if (result) {
+				if (iddirty) {
+					buffer_mark_dirty(idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptr[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		buffer_release(idbuf);
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+	}
+	else {
+		if (iddirty) {
+			/* The indirect block is dirty */
+			buffer_mark_dirty(idbuf);
+		}
+		buffer_release(idbuf);
+	}
+	return 0;
+}
 
+/*
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * the vnode's lock (or, in sfs_reclaim, be its only user).
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *rootp;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock, span, old;
+	unsigned level;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	/* The cached leaf may be about to change or go away. */
+	sv->sv_mapvalid = false;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -236,68 +420,38 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Then each level of indirect blocks, where the new EOF falls
+	 * short of the end of what it maps.
+	 */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+	for (level=1; level<=SFS_IDLEVELS; level++) {
+		rootp = sfs_idroot(sv, level);
+		span = sfs_idspan(level);
+		if (*rootp != 0 && blocklen < baseblock + span) {
+			old = *rootp;
+			result = sfs_itrunc_indirect(sfs, rootp, level,
+						     baseblock, blocklen);
+			if (*rootp != old) {
+				sfs_dirty_inode(sv);
 			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
 		}
+		baseblock += span;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
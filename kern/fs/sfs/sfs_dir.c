@@ -34,8 +34,11 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/dirent.h>
 #include <lib.h>
+#include <uio.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -95,55 +98,353 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Name index
+//
+// The first lookup in a directory reads it all in and builds a hash
+// of its names, and a list of its free slots, so that later lookups
+// and creates don't have to read every entry again. The index lives
+// as long as the vnode does, and is kept up to date by
+// sfs_dir_link and sfs_dir_unlink (and so by rename).
+
+/* Number of hash chains per directory. */
+#define SFS_DIRHASH_SIZE 32
+
+struct sfs_dirname {
+	struct sfs_dirname *dn_next;	/* hash chain */
+	uint32_t dn_ino;		/* inode number */
+	int dn_slot;			/* slot in the directory */
+	char dn_name[SFS_NAMELEN];	/* null-terminated name */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname *di_hash[SFS_DIRHASH_SIZE];
+	int *di_free;			/* stack of free slots */
+	unsigned di_nfree;		/* number of free slots */
+	unsigned di_maxfree;		/* size of di_free */
+};
+
+static
+unsigned
+sfs_dirhashfn(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % SFS_DIRHASH_SIZE;
+}
+
+static
+struct sfs_dirname *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirname *dn;
+
+	for (dn = di->di_hash[sfs_dirhashfn(name)];
+	     dn != NULL; dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			return dn;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_dirindex_insert(struct sfs_dirindex *di, struct sfs_dirname *dn)
+{
+	unsigned h = sfs_dirhashfn(dn->dn_name);
+
+	dn->dn_next = di->di_hash[h];
+	di->di_hash[h] = dn;
+}
+
+static
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, struct sfs_dirname *dn)
+{
+	struct sfs_dirname **dnp;
+
+	dnp = &di->di_hash[sfs_dirhashfn(dn->dn_name)];
+	while (*dnp != dn) {
+		KASSERT(*dnp != NULL);
+		dnp = &(*dnp)->dn_next;
+	}
+	*dnp = dn->dn_next;
+}
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Make room on the free slot stack for one more entry.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirindex_reservefree(struct sfs_dirindex *di)
 {
-	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	int *newfree;
+	unsigned newmax;
 
-	nentries = sfs_dir_nentries(sv);
+	if (di->di_nfree < di->di_maxfree) {
+		return 0;
+	}
+	newmax = di->di_maxfree ? di->di_maxfree * 2 : 8;
+	newfree = kmalloc(newmax * sizeof(int));
+	if (newfree == NULL) {
+		return ENOMEM;
+	}
+	if (di->di_nfree > 0) {
+		memcpy(newfree, di->di_free, di->di_nfree * sizeof(int));
+	}
+	kfree(di->di_free);
+	di->di_free = newfree;
+	di->di_maxfree = newmax;
+	return 0;
+}
+
+/*
+ * Free a directory's index, if it has one.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirname *dn;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<SFS_DIRHASH_SIZE; i++) {
+		while ((dn = di->di_hash[i]) != NULL) {
+			di->di_hash[i] = dn->dn_next;
+			kfree(dn);
+		}
+	}
+	kfree(di->di_free);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
 
-	/* For each slot... */
-	found = 0;
-	for (i=0; i<nentries; i++) {
+/*
+ * Read the whole directory, a block at a time, and build its index.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *sds;
+	struct sfs_dirindex *di;
+	struct sfs_dirname *dn;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+	int nentries, slot, n, i;
+	int result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DIRHASH_SIZE; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_free = NULL;
+	di->di_nfree = di->di_maxfree = 0;
+	/* (attach it now so sfs_dir_dropindex can clean up after us) */
+	sv->sv_dirindex = di;
+
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		sfs_dir_dropindex(sv);
+		return ENOMEM;
+	}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, i, &tsd);
+	nentries = sfs_dir_nentries(sv);
+	for (slot=0; slot<nentries; slot+=perblock) {
+		n = nentries - slot;
+		if (n > perblock) {
+			n = perblock;
+		}
+		result = sfs_metaio(sv, slot * sizeof(struct sfs_direntry),
+				    sds, n * sizeof(struct sfs_direntry),
+				    UIO_READ);
 		if (result) {
-			return result;
+			goto fail;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
+
+		for (i=0; i<n; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				result = sfs_dirindex_reservefree(di);
+				if (result) {
+					goto fail;
+				}
+				di->di_free[di->di_nfree++] = slot + i;
+				continue;
 			}
-		}
-		else {
+
 			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+			sds[i].sfd_name[sizeof(sds[i].sfd_name)-1] = 0;
+
+			/* Each name may legally appear only once... */
+			if (sfs_dirindex_find(di, sds[i].sfd_name) != NULL) {
+				panic("sfs: %s: directory %u: name %s "
+				      "appears twice\n",
+				      sfs->sfs_sb.sb_volname, sv->sv_ino,
+				      sds[i].sfd_name);
+			}
 
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+			dn = kmalloc(sizeof(*dn));
+			if (dn == NULL) {
+				result = ENOMEM;
+				goto fail;
+			}
+			dn->dn_ino = sds[i].sfd_ino;
+			dn->dn_slot = slot + i;
+			strcpy(dn->dn_name, sds[i].sfd_name);
+			sfs_dirindex_insert(di, dn);
+		}
+	}
 
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+	kfree(sds);
+	return 0;
+
+ fail:
+	kfree(sds);
+	sfs_dir_dropindex(sv);
+	return result;
+}
+
+/*
+ * List the directory into UIO as struct dirent records, as many as
+ * fit, starting at slot uio_offset; leave the slot to carry on from
+ * in uio_offset. (See vop_getdirentries.)
+ */
+int
+sfs_dir_getentries(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *sds;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+	size_t startresid = uio->uio_resid;
+	int nentries, slot, n, i;
+	uint16_t type;
+	unsigned dtype;
+	int result = 0;
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+	nentries = sfs_dir_nentries(sv);
+	if (uio->uio_offset >= nentries) {
+		/* EOF */
+		return 0;
+	}
+	slot = uio->uio_offset;
+
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		return ENOMEM;
+	}
+
+	while (slot < nentries) {
+		/* The rest of the block SLOT is in */
+		n = perblock - slot % perblock;
+		if (n > nentries - slot) {
+			n = nentries - slot;
+		}
+		result = sfs_metaio(sv, slot * sizeof(struct sfs_direntry),
+				    sds, n * sizeof(struct sfs_direntry),
+				    UIO_READ);
+		if (result) {
+			break;
+		}
+
+		for (i=0; i<n; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				continue;
 			}
+			sds[i].sfd_name[sizeof(sds[i].sfd_name)-1] = 0;
+
+			result = sfs_inode_type(sfs, sds[i].sfd_ino, &type);
+			if (result) {
+				break;
+			}
+			switch (type) {
+			    case SFS_TYPE_DIR:
+				dtype = DT_DIR;
+				break;
+			    case SFS_TYPE_FILE:
+				dtype = DT_REG;
+				break;
+			    default:
+				dtype = DT_UNKNOWN;
+				break;
+			}
+			result = vfs_dirent_emit(uio, sds[i].sfd_ino, dtype,
+						 sds[i].sfd_name);
+			if (result) {
+				break;
+			}
+		}
+		slot += i;
+		if (result) {
+			break;
 		}
 	}
+	kfree(sds);
 
-	return found ? 0 : ENOENT;
+	if (result == ENOSPC) {
+		/* Out of room; only an error if nothing fit */
+		result = uio->uio_resid == startresid ? EINVAL : 0;
+	}
+	uio->uio_offset = slot;
+	return result;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * Like everything else in this file, must be called with the
+ * directory's sv_lock held.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirname *dn;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	if (sv->sv_dirindex == NULL) {
+		result = sfs_dir_buildindex(sv);
+		if (result) {
+			return result;
+		}
+	}
+	di = sv->sv_dirindex;
+
+	/* Report back a free slot if one was requested */
+	if (emptyslot != NULL && di->di_nfree > 0) {
+		*emptyslot = di->di_free[di->di_nfree - 1];
+	}
+
+	dn = sfs_dirindex_find(di, name);
+	if (dn == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = dn->dn_slot;
+	}
+	if (ino != NULL) {
+		*ino = dn->dn_ino;
+	}
+	return 0;
 }
 
 /*
@@ -156,6 +457,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_dirname *dn;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -180,13 +483,35 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* and its index entry (findname built the index) */
+	di = sv->sv_dirindex;
+	dn = kmalloc(sizeof(*dn));
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_ino = ino;
+	dn->dn_slot = emptyslot;
+	strcpy(dn->dn_name, name);
+
+	/* Write the entry. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		kfree(dn);
+		return result;
+	}
+
+	/* Now that it's there, update the index. */
+	if (di->di_nfree > 0 && di->di_free[di->di_nfree - 1] == emptyslot) {
+		di->di_nfree--;
+	}
+	sfs_dirindex_insert(di, dn);
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	return 0;
 }
 
 /*
@@ -195,14 +520,45 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirname *dn;
 	struct sfs_direntry sd;
+	int result;
+
+	if (di != NULL) {
+		/* Find the name that's going away, and make room for its slot */
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		dn = sfs_dirindex_find(di, sd.sfd_name);
+		KASSERT(dn != NULL && dn->dn_slot == slot);
+		result = sfs_dirindex_reservefree(di);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		dn = NULL;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (di != NULL) {
+		sfs_dirindex_remove(di, dn);
+		kfree(dn);
+		di->di_free[di->di_nfree++] = slot;
+	}
+	return 0;
 }
 
 /*
@@ -38,9 +38,11 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -51,94 +53,93 @@
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
 
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
- *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
- *
- * The sectors used by the superblock and the bitmap itself are
- * likewise marked in use by mksfs.
- */
-static
-int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
-{
-	uint32_t j, freemapblocks;
-	char *freemapdata;
-	int result;
-
-	/* Number of blocks in the free block bitmap. */
-	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
-
-	/* Pointer to our freemap data in memory. */
-	freemapdata = bitmap_getdata(sfs->sfs_freemap);
-
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
-
-		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
-
-		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
-		}
-		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
-		}
-
-		/* If we failed, stop. */
-		if (result) {
-			return result;
-		}
-	}
-	return 0;
-}
-
-/*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table: write back the inodes on the
+ * dirty list. Clean vnodes aren't looked at.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct sfs_vnode **svs;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result, err = 0;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Take a reference to every dirty vnode so they stay put
+	 * while we go over them with the list unlocked. (A vnode's
+	 * lock comes before sfs_vnlock and sfs_dirtylock, so we can't
+	 * hold those while we sync it.) Holding sfs_vnlock keeps
+	 * sfs_reclaim from freeing one under us meanwhile.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_dirtylock);
+	num = 0;
+	for (sv = sfs->sfs_dirtyhead; sv != NULL; sv = sv->sv_dirtynext) {
+		num++;
+	}
+	if (num == 0) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(num * sizeof(*svs));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	i = 0;
+	for (sv = sfs->sfs_dirtyhead; sv != NULL; sv = sv->sv_dirtynext) {
+		VOP_INCREF(&sv->sv_absvn);
+		svs[i++] = sv;
+	}
+	lock_release(sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Sync each one. (Not VOP_FSYNC, which would flush the buffer
+	 * cache every time; sfs_sync does that once at the end.)
+	 */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = svs[i];
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		if (result && err == 0) {
+			err = result;
+		}
+		VOP_DECREF(&sv->sv_absvn);
 	}
-	return 0;
+	kfree(svs);
+	return err;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap: write the blocks of it that changed.
  */
 static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
+	uint32_t j, freemapblocks;
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (j=0; j<freemapblocks; j++) {
+		if (!bitmap_isset(sfs->sfs_freemapdirty, j)) {
+			continue;
+		}
+		result = sfs_freemapio(sfs, j, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
+		bitmap_unmark(sfs->sfs_freemapdirty, j);
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +153,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +178,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +213,30 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/*
+	 * All of the above only went as far as the buffer cache; now
+	 * write out everything that's dirty, in one pass in block order.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +250,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The superblock's volume name never changes once mounted */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +265,17 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirty);
+	}
+	if (sfs->sfs_freemaploaded != NULL) {
+		bitmap_destroy(sfs->sfs_freemaploaded);
+	}
+	kfree(sfs->sfs_freecount);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_dirtylock);
 	vnodearray_destroy(sfs->sfs_vnodes);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +290,55 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	uint32_t j;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
+	/*
+	 * Throw out the inactive vnodes, then see if we have any
+	 * files open. If so, can't unmount. Lookups run without
+	 * vfs_biglock, but a new one can't get a starting vnode here,
+	 * because getdevice needs the biglock, which the VFS layer
+	 * holds; and one already in flight holds a reference to a
+	 * vnode on this volume, which the check below catches.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_inactive_trim(sfs, 0);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		return result;
+	}
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_dirtyhead == NULL);
+	for (j=0; j<SFS_FS_FREEMAPBLOCKS(sfs); j++) {
+		KASSERT(!bitmap_isset(sfs->sfs_freemapdirty, j));
+	}
+
+	/*
+	 * The inactive vnodes were synced along with everything else,
+	 * but write out anything they left behind before dropping
+	 * our blocks from the buffer cache.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Leave the free counts behind for the next mount. This
+	 * comes last, as nothing may change them once it's on disk.
+	 */
+	result = sfs_freemap_summarize(sfs);
+	if (result) {
+		return result;
+	}
+	buffer_purge(sfs->sfs_device);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +347,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +370,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -351,17 +401,43 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
 	sfs->sfs_vnodes = vnodearray_create();
 	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+		goto cleanup_vnlock;
+	}
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_inacthead = sfs->sfs_inacttail = NULL;
+	sfs->sfs_ninactive = 0;
+	sfs->sfs_dirtylock = lock_create("sfs_dirtylock");
+	if (sfs->sfs_dirtylock == NULL) {
+		goto cleanup_vnodes;
 	}
+	sfs->sfs_dirtyhead = sfs->sfs_dirtytail = NULL;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_dirtylock;
+	}
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirty = NULL;
+	sfs->sfs_freemaploaded = NULL;
+	sfs->sfs_freecount = NULL;
 
 	return sfs;
 
+cleanup_dirtylock:
+	lock_destroy(sfs->sfs_dirtylock);
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +464,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +476,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +483,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -421,9 +493,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		buffer_purge(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -434,9 +506,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		buffer_purge(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -448,26 +520,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
-	/* Load free block bitmap */
-	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
-		sfs->sfs_device = NULL;
-		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
-	}
-	result = sfs_freemapio(sfs, UIO_READ);
+	/* Set up the free block bitmap (usually without reading it) */
+	result = sfs_freemap_setup(sfs);
 	if (result) {
+		buffer_purge(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
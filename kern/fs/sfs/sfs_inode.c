@@ -35,13 +35,45 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Note that the in-memory inode has changed, and put the vnode on the
+ * dirty list for sfs_sync to find. The caller must hold the vnode's
+ * lock (or be creating it).
+ */
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_dirty) {
+		return;
+	}
+	sv->sv_dirty = true;
+
+	lock_acquire(sfs->sfs_dirtylock);
+	sv->sv_dirtyprev = sfs->sfs_dirtytail;
+	sv->sv_dirtynext = NULL;
+	if (sfs->sfs_dirtytail != NULL) {
+		sfs->sfs_dirtytail->sv_dirtynext = sv;
+	}
+	else {
+		sfs->sfs_dirtyhead = sv;
+	}
+	sfs->sfs_dirtytail = sv;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+/*
+ * Write an on-disk inode structure back out to disk, if it changed,
+ * and take it off the dirty list. The caller must hold the vnode's
+ * lock (or be sfs_reclaim).
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,20 +81,252 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
-	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+	if (!sv->sv_dirty) {
+		return 0;
+	}
+
+	result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
+				sizeof(sv->sv_i));
+	if (result) {
+		return result;
+	}
+	sv->sv_dirty = false;
+
+	lock_acquire(sfs->sfs_dirtylock);
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		sfs->sfs_dirtyhead = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	else {
+		sfs->sfs_dirtytail = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	lock_release(sfs->sfs_dirtylock);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Vnode table (sfs_vnlock held)
+
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino % SFS_VNHASH_SIZE;
+}
+
+/*
+ * Find the loaded vnode for inode INO, if there is one.
+ */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfn(ino)];
+	     sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Enter a vnode in both the array and the hash.
+ */
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+	int result;
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn,
+				&sv->sv_tableix);
+	if (result) {
+		return result;
+	}
+
+	h = sfs_vnhashfn(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	return 0;
+}
+
+/*
+ * Take a vnode out of both. The array isn't kept in any order, so
+ * fill the hole with the last entry rather than shifting.
+ */
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+	struct sfs_vnode *last;
+	unsigned num;
+
+	svp = &sfs->sfs_vnhash[sfs_vnhashfn(sv->sv_ino)];
+	while (*svp != sv) {
+		if (*svp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		svp = &(*svp)->sv_hashnext;
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_tableix < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_tableix)
+		== &sv->sv_absvn);
+	last = vnodearray_get(sfs->sfs_vnodes, num-1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_tableix, &last->sv_absvn);
+	last->sv_tableix = sv->sv_tableix;
+	vnodearray_setsize(sfs->sfs_vnodes, num-1);
+}
+
+////////////////////////////////////////////////////////////
+// Inactive list (sfs_vnlock held)
+
+static
+void
+sfs_inactive_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_inactive);
+	sv->sv_inactive = true;
+	sv->sv_inactprev = sfs->sfs_inacttail;
+	sv->sv_inactnext = NULL;
+	if (sfs->sfs_inacttail != NULL) {
+		sfs->sfs_inacttail->sv_inactnext = sv;
+	}
+	else {
+		sfs->sfs_inacthead = sv;
+	}
+	sfs->sfs_inacttail = sv;
+	sfs->sfs_ninactive++;
+}
+
+static
+void
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_inactive);
+	if (sv->sv_inactprev != NULL) {
+		sv->sv_inactprev->sv_inactnext = sv->sv_inactnext;
+	}
+	else {
+		sfs->sfs_inacthead = sv->sv_inactnext;
+	}
+	if (sv->sv_inactnext != NULL) {
+		sv->sv_inactnext->sv_inactprev = sv->sv_inactprev;
+	}
+	else {
+		sfs->sfs_inacttail = sv->sv_inactprev;
+	}
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sv->sv_inactive = false;
+	KASSERT(sfs->sfs_ninactive > 0);
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Write back and free a vnode nobody else has a reference to.
+ */
+static
+int
+sfs_vnode_destroy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	int result;
+
+	KASSERT(!sv->sv_inactive);
+
+	/* If there are no on-disk references to the file either, erase it. */
+	if (sv->sv_i.sfi_linkcount == 0) {
+		result = sfs_itrunc(sv, 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Sync the inode to disk */
+	result = sfs_sync_inode(sv);
+	if (result) {
+		return result;
+	}
+
+	/* If there are no on-disk references, discard the inode */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_bfree(sfs, sv->sv_ino);
+	}
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vntable_remove(sfs, sv);
+
+	vnode_cleanup(&sv->sv_absvn);
+
+	/* Release the storage for the vnode structure itself. */
+	sfs_dir_dropindex(sv);
+	kfree(sv->sv_map);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+
+	return 0;
+}
+
+/*
+ * Free inactive vnodes, oldest first, until at most KEEP are left.
+ * Ones that sfs_sync_vnodes has borrowed for the moment are skipped.
+ */
+int
+sfs_inactive_trim(struct sfs_fs *sfs, unsigned keep)
+{
+	struct sfs_vnode *sv, *next;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_inacthead;
+	     sv != NULL && sfs->sfs_ninactive > keep; sv = next) {
+		next = sv->sv_inactnext;
+
+		spinlock_acquire(&sv->sv_absvn.vn_countlock);
+		if (sv->sv_absvn.vn_refcount != 1) {
+			spinlock_release(&sv->sv_absvn.vn_countlock);
+			continue;
+		}
+		spinlock_release(&sv->sv_absvn.vn_countlock);
+
+		sfs_inactive_remove(sfs, sv);
+		result = sfs_vnode_destroy(sfs, sv);
 		if (result) {
+			/* Leave it where it was and try again later. */
+			sfs_inactive_add(sfs, sv);
 			return result;
 		}
-		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * If the file still has links, the vnode is kept on the inactive
+ * list, holding on to the reference we were handed, in case it's
+ * looked up again soon. Otherwise, or once it falls off the end of
+ * the list, it is written back and freed.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 int
@@ -70,15 +334,20 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * sfs_loadvnode hands out new references under sfs_vnlock, so
+	 * holding it keeps anyone from picking the vnode up again.
+	 * We keep it until the vnode is out of the table, so nobody
+	 * can load a second copy of the inode before this one's been
+	 * written back either.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,57 +357,33 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+		/* Nobody can open it again; get rid of it now. */
+		result = sfs_vnode_destroy(sfs, sv);
+		lock_release(sfs->sfs_vnlock);
+		return result;
 	}
 
-	/* Sync the inode to disk */
+	/*
+	 * Push the inode out to the buffer cache, so it doesn't sit
+	 * dirty in here until the next sync, and park the vnode.
+	 */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	sfs_inactive_add(sfs, sv);
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Failing to trim isn't this vnode's problem; it'll be retried. */
+	(void)sfs_inactive_trim(sfs, SFS_INACTIVE_MAX);
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
-	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
-
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
-
-	/* Done */
+	lock_release(sfs->sfs_vnlock);
 	return 0;
 }
 
@@ -150,42 +395,53 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		/*
+		 * Found. (It was checked to be in an allocated block
+		 * when it was loaded, and blocks of loaded inodes
+		 * aren't freed until reclaim.)
+		 */
+
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		if (sv->sv_inactive) {
+			/* Take over the reference the list was holding */
+			sfs_inactive_remove(sfs, sv);
 		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		/* Short of memory; give back what the inactive list holds */
+		(void)sfs_inactive_trim(sfs, 0);
+		sv = kmalloc(sizeof(struct sfs_vnode));
+	}
+	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -198,7 +454,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -213,7 +471,6 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
 	}
 
 	/*
@@ -235,26 +492,88 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_inactive = false;
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	sv->sv_dirindex = NULL;
+	sv->sv_map = NULL;
+	sv->sv_mapvalid = false;
+	sv->sv_mapbase = 0;
+	sv->sv_rapos = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	/* A new object's type has yet to be written out */
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_dirty_inode(sv);
+	}
+
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
+/*
+ * Find out the type (SFS_TYPE_*) of inode INO without loading a vnode
+ * for it, for directory listings. If it is loaded, go by the vnode;
+ * a new object's type may not have been written out yet.
+ */
+int
+sfs_inode_type(struct sfs_fs *sfs, uint32_t ino, uint16_t *type)
+{
+	struct sfs_vnode *sv;
+	struct buf *buf;
+	struct sfs_dinode *dino;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		*type = sv->sv_i.sfi_type;
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Not loaded, so the inode block is up to date (it is synced
+	 * before the vnode leaves the table). Read it without the
+	 * table lock, so as not to hold up everyone else's loads for a
+	 * disk read; if it gets loaded meanwhile that's fine, as the
+	 * type doesn't change.
+	 */
+	result = buffer_read(sfs->sfs_device, ino, &buf);
+	if (result) {
+		return result;
+	}
+	dino = buffer_map(buf);
+	*type = dino->sfi_type;
+	buffer_release(buf);
+
+	return 0;
+}
+
 /*
  * Create a new filesystem object and hand back its vnode.
  */
@@ -269,7 +588,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +615,21 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* (the type never changes, so no need to lock) */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -38,6 +38,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,74 +47,36 @@
 // Basic block-level I/O routines
 
 /*
+ * All block I/O goes through the buffer cache (see buf.h), which
+ * also handles retrying I/O errors and writes dirty blocks back on
+ * its own time. These two copy a whole block in or out of a buffer
+ * for callers that keep their own copy, like the superblock, the
+ * freemap and the in-memory inodes.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
  */
 
-/*
- * Read or write a block, retrying I/O errors.
- */
-static
-int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
-{
-	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
-
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
-}
-
 /*
  * Read a block.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
@@ -122,13 +85,19 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +119,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +130,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +142,35 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)buffer_map(buf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty (even if we only
+	 * got part of the way; that counts as a short write).
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(buf);
 	}
 
-	return 0;
+	buffer_release(buf);
+	return result;
 }
 
 /*
@@ -228,14 +181,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,36 +207,100 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+		buffer_release(buf);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * Writing the whole block: no need to read the old contents.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
+	result = buffer_get(sfs->sfs_device, diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+	if (result == 0 || buf->b_valid) {
+		/* (a short write into a cached block still counts) */
+		buffer_mark_dirty(buf);
+	}
+	else {
+		/* Partly garbage; forget it */
+		buffer_invalidate(buf);
+	}
+	buffer_release(buf);
 	return result;
 }
 
+/*
+ * Readahead. A read that starts where the previous one ended is
+ * taken as sequential: the window starts at SFS_RA_MIN blocks and
+ * doubles on each further sequential read up to SFS_RA_MAX; any other
+ * read closes it. Blocks in the window past the end of the read are
+ * handed to the buffer cache to fetch in the background (sv_raend
+ * remembers how far we've already asked for).
+ */
+#define SFS_RA_MIN  2
+#define SFS_RA_MAX  16
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, lastblock, nblocks;
+	daddr_t diskblock;
+
+	if (startpos != sv->sv_rapos) {
+		/* Not sequential */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		sv->sv_rapos = endpos;
+		return;
+	}
+	sv->sv_rapos = endpos;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MIN;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* Blocks after the one the read ended in, up to EOF */
+	fileblock = DIVROUNDUP(endpos, SFS_BLOCKSIZE);
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	lastblock = fileblock + sv->sv_rawindow;
+	if (lastblock > nblocks) {
+		lastblock = nblocks;
+	}
+	if (fileblock < sv->sv_raend) {
+		fileblock = sv->sv_raend;
+	}
+
+	for (; fileblock < lastblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	if (fileblock > sv->sv_raend) {
+		sv->sv_raend = fileblock;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The caller holds the vnode's lock.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
@@ -295,8 +309,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t startpos;
 
 	origresid = uio->uio_resid;
+	startpos = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -378,7 +394,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
+	}
+
+	/* If reading and it went fine, think about readahead */
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, startpos, uio->uio_offset);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -407,6 +428,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,18 +437,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,32 +457,31 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = buffer_read(sfs->sfs_device, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
+		memcpy(ioptr + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* It'll get written back later */
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
@@ -43,7 +43,10 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_freemapio(struct sfs_fs *sfs, uint32_t j, enum uio_rw rw);
+int sfs_freemap_setup(struct sfs_fs *sfs);
+int sfs_freemap_summarize(struct sfs_fs *sfs);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t hint, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
@@ -58,16 +61,21 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
+int sfs_dir_getentries(struct sfs_vnode *sv, struct uio *uio);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+void sfs_dirty_inode(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_inactive_trim(struct sfs_fs *sfs, unsigned keep);
+int sfs_inode_type(struct sfs_fs *sfs, uint32_t ino, uint16_t *type);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
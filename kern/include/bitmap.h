@@ -38,10 +38,23 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      Always the lowest cleared bit.
+ *     bitmap_alloc_near - same, but the first cleared bit at or after
+ *                      HINT, wrapping around to the start if need be.
+ *     bitmap_find_run - locate LEN cleared bits in a row, at or after
+ *                      HINT if possible, and return the first index.
+ *     bitmap_alloc_range - same, and set them all.
+ *     bitmap_rescan  - note that bits at and after INDEX were cleared
+ *                      through the bitmap_getdata pointer.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
+ *
+ * Bits may be set directly through the pointer from bitmap_getdata.
+ * The bitmap keeps track of where the lowest cleared bit might be, so
+ * bits cleared that way (e.g. by reading part of the map in from
+ * disk) must be followed by bitmap_rescan.
  */
 
 
@@ -50,6 +63,13 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned hint,
+                                 unsigned *index);
+int            bitmap_find_run(struct bitmap *, unsigned hint, unsigned len,
+                               unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned hint,
+                                  unsigned len, unsigned *index);
+void           bitmap_rescan(struct bitmap *, unsigned index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
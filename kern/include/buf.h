@@ -0,0 +1,127 @@
+/*
+ * Block buffer cache.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+#include <device.h>
+
+/*
+ * Size of a buffer. Only devices with this block size can be cached.
+ */
+#define BUFFER_SIZE 512
+
+/*
+ * Soft limit on the number of buffers. Unreferenced buffers are
+ * recycled in LRU order once it is reached, clean ones first; if every
+ * buffer is in use, the cache grows past it rather than waiting.
+ */
+#define BUFFER_MAX 128
+
+/*
+ * Write-back policy. Writes only dirty the buffer; the flusher thread
+ * wakes up every second and writes out buffers that have been dirty
+ * for BUFFER_FLUSH_AGE seconds, or, if more than BUFFER_DIRTY_HIGH
+ * buffers are dirty, the oldest ones until BUFFER_DIRTY_LOW are left.
+ * buffer_sync writes out everything for a device (FS_SYNC, fsync).
+ * Each pass writes a batch of up to BUFFER_BATCH buffers in block
+ * order, all queued at once on devices that have devop_strategy.
+ */
+#define BUFFER_FLUSH_AGE	5
+#define BUFFER_DIRTY_HIGH	(BUFFER_MAX / 2)
+#define BUFFER_DIRTY_LOW	(BUFFER_MAX / 4)
+#define BUFFER_BATCH		32
+
+/*
+ * Readahead. buffer_readahead queues a block to be read into the
+ * cache by the readahead thread, without waiting for it; requests
+ * beyond BUFFER_RAQUEUE pending ones are dropped.
+ */
+#define BUFFER_RAQUEUE		64
+
+/*
+ * One cached block, identified by (device, block number).
+ *
+ * A buffer handed out by buffer_read or buffer_get is owned by the
+ * caller (b_busy) until buffer_release; nobody else can see or
+ * change its contents in the meantime, and it cannot be recycled.
+ * b_refcount counts the owner plus any threads waiting to own it.
+ * Unreferenced buffers sit on the LRU list, oldest first. Dirty
+ * buffers are also on the dirty list, in the order they got dirty.
+ *
+ * All fields except b_data are protected by the cache lock; b_data
+ * belongs to the owner.
+ */
+struct buf {
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list */
+	struct buf *b_lrunext;
+	struct buf *b_dirtyprev;	/* dirty list */
+	struct buf *b_dirtynext;
+	struct device *b_dev;		/* device */
+	daddr_t b_block;		/* block number on b_dev */
+	unsigned b_refcount;		/* owner + waiters */
+	bool b_busy;			/* owned by someone */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data newer than the disk */
+	bool b_readahead;		/* prefetched and not used yet */
+	time_t b_dirtytime;		/* when it became dirty (seconds) */
+	void *b_data;			/* BUFFER_SIZE bytes */
+	struct bio b_bio;		/* write-back request (owner's) */
+};
+
+/*
+ * Functions:
+ *
+ *     buffer_bootstrap   - Set up the cache at boot time.
+ *
+ *     buffer_read        - Get the buffer for BLOCK of DEV, reading it
+ *                          in from disk if it isn't cached.
+ *
+ *     buffer_get         - Same, but don't read; for callers about to
+ *                          overwrite the whole block. The contents are
+ *                          garbage unless b_valid; call
+ *                          buffer_mark_valid once they've been filled.
+ *
+ *     buffer_map         - Return the data of an owned buffer.
+ *
+ *     buffer_mark_dirty  - Note that an owned buffer has been changed
+ *                          and must eventually be written out. Also
+ *                          marks it valid.
+ *
+ *     buffer_invalidate  - Forget the contents of an owned buffer that
+ *                          was never filled in properly.
+ *
+ *     buffer_release     - Give up ownership of a buffer.
+ *
+ *     buffer_drop        - Forget BLOCK of DEV, even if it's dirty,
+ *                          because the filesystem freed it.
+ *
+ *     buffer_sync        - Write out all dirty buffers of DEV.
+ *
+ *     buffer_purge       - Drop every buffer of DEV (at unmount time,
+ *                          after buffer_sync). Waits for any that are
+ *                          in use.
+ *
+ *     buffer_readahead   - Start reading BLOCK of DEV into the cache
+ *                          in the background, if it isn't there.
+ *
+ *     buffer_printstats  - Print hit, miss and readahead counters.
+ */
+void buffer_bootstrap(void);
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_invalidate(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_drop(struct device *dev, daddr_t block);
+int buffer_sync(struct device *dev);
+void buffer_purge(struct device *dev);
+void buffer_readahead(struct device *dev, daddr_t block);
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
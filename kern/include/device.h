@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct bio;  /* below */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +57,15 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_strategy - queue a block I/O request and return without
+ *                       waiting for it (optional; NULL if the device
+ *                       only does devop_io)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_strategy)(struct device *, struct bio *);
 };
 
 /*
@@ -69,6 +74,56 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_STRATEGY(d, b)	((d)->d_ops->devop_strategy(d, b))
+#define DEVOP_HASSTRATEGY(d)	((d)->d_ops->devop_strategy != NULL)
+
+
+/*
+ * Asynchronous block I/O request.
+ *
+ * The caller fills in the first group of fields and hands the request
+ * to devop_strategy, which either fails it right away (returning an
+ * error; bio_done is not called) or queues it and returns 0. When the
+ * transfer is over the driver sets bio_error and calls bio_done. That
+ * happens in interrupt context, so bio_done must not sleep; bio_wakeup
+ * is a bio_done for callers that just want to bio_wait.
+ *
+ * bio_data must be kernel memory. It, and the bio itself, belong to
+ * the driver until bio_done is called.
+ */
+struct bio {
+	daddr_t bio_block;		/* first block */
+	unsigned bio_nblocks;		/* number of blocks */
+	void *bio_data;			/* bio_nblocks * d_blocksize bytes */
+	bool bio_write;			/* direction */
+	void (*bio_done)(struct bio *);	/* completion callback */
+	void *bio_arg;			/* for bio_done */
+
+	int bio_error;			/* result, set by the driver */
+	volatile bool bio_finished;	/* set by bio_wakeup */
+
+	/* For the driver's use */
+	struct bio *bio_next;		/* request queue */
+	struct bio *bio_chain;		/* merged requests, in block order */
+	struct bio *bio_chaintail;
+};
+
+/*
+ * Block I/O functions (vfs/bio.c):
+ *
+ *     bio_bootstrap - set up at boot time.
+ *     bio_init      - fill in a request, with bio_wakeup as bio_done.
+ *     bio_wakeup    - completion callback that wakes up bio_wait.
+ *     bio_wait      - wait for a request using bio_wakeup to finish.
+ *     bio_io        - do a request with devop_strategy and wait for it.
+ */
+void bio_bootstrap(void);
+void bio_init(struct bio *bio, daddr_t block, unsigned nblocks,
+	      void *data, bool write);
+void bio_wakeup(struct bio *bio);
+void bio_wait(struct bio *bio);
+int bio_io(struct device *d, daddr_t block, unsigned nblocks,
+	   void *data, bool write);
 
 
 /* Create vnode for a vfs-level device. */
@@ -0,0 +1,75 @@
+/*
+ * Per-process file descriptor table.
+ */
+
+#ifndef _FDTABLE_H_
+#define _FDTABLE_H_
+
+
+#include <spinlock.h>
+
+struct bitmap;			/* from <bitmap.h> */
+struct systemFileTable;		/* from <vfs.h> */
+
+/*
+ * Maps a process's fds to entries of the system open file table.
+ *
+ * Slots start out in a small array inside the structure; a process
+ * that goes past that gets a heap array, doubled each time it fills
+ * up, until FD_MAX. A bitmap of the slots in use gives lowest-free
+ * fd allocation without looking at the pointers.
+ *
+ * FD_MAX may be larger than OPEN_MAX; the system-wide limit is
+ * still SYSTEM_OPEN_MAX open files.
+ *
+ * A table is shared copy-on-write between a parent and the children
+ * it forks: fork just takes another reference, and whoever first
+ * wants to change the table (open, close, dup2) calls fdtable_unshare
+ * to get a private copy. Each table holds one count_refs reference
+ * on every open file in it, no matter how many processes share it.
+ * Only a process holding the sole reference may modify a table, so
+ * lookups need no locking; ft_lock only covers ft_refcount.
+ */
+
+#define FDTABLE_INLINE	16		/* slots before the first grow */
+#ifndef FD_MAX
+#define FD_MAX		1024		/* hard per-process limit */
+#endif
+
+struct fdtable {
+	struct systemFileTable **ft_files;	/* ft_inline, or heap array */
+	unsigned ft_size;			/* number of slots in ft_files */
+	struct bitmap *ft_used;			/* which slots are in use */
+	struct systemFileTable *ft_inline[FDTABLE_INLINE];
+	unsigned ft_refcount;			/* processes using this table */
+	struct spinlock ft_lock;		/* protects ft_refcount */
+};
+
+/*
+ * Functions:
+ *     fdtable_create  - allocate an empty table. Returns NULL on error.
+ *     fdtable_incref  - share the table with one more process.
+ *     fdtable_decref  - drop a reference. The last one closes (drops
+ *                       the count_refs of) every open file and frees
+ *                       the table.
+ *     fdtable_unshare - make *FTP private to the caller, copying it if
+ *                       it is shared. Returns ENOMEM on error.
+ *     fdtable_get     - return the open file at FD, or NULL if FD is
+ *                       out of range or not open.
+ *     fdtable_alloc   - put SF at the lowest free fd and return it in
+ *                       *FD. Returns EMFILE or ENOMEM on error.
+ *     fdtable_place   - put SF at the (free) slot FD, growing the
+ *                       table if needed. Returns EBADF or ENOMEM.
+ *     fdtable_remove  - clear FD and return what was there.
+ */
+struct fdtable *fdtable_create(void);
+void fdtable_incref(struct fdtable *ft);
+void fdtable_decref(struct fdtable *ft);
+int fdtable_unshare(struct fdtable **ftp);
+struct systemFileTable *fdtable_get(struct fdtable *ft, int fd);
+int fdtable_alloc(struct fdtable *ft, struct systemFileTable *sf, int *fd);
+int fdtable_place(struct fdtable *ft, int fd, struct systemFileTable *sf);
+struct systemFileTable *fdtable_remove(struct fdtable *ft, int fd);
+
+
+#endif /* _FDTABLE_H_ */
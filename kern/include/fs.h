@@ -36,12 +36,15 @@ struct vnode; /* in vnode.h */
 /*
  * Abstract file system. (Or device accessible as a file.)
  *
- * fs_data is a pointer to filesystem-specific data.
+ * fs_data is a pointer to filesystem-specific data. fs_dcachegen
+ * belongs to the lookup cache (vfsdcache.c), and is set up by vfslist.c
+ * when the filesystem is attached.
  */
 
 struct fs {
 	void *fs_data;
 	const struct fs_ops *fs_ops;
+	unsigned fs_dcachegen;
 };
 
 /*
@@ -0,0 +1,34 @@
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+#include <kern/limits.h>
+
+/*
+ * Directory entry records, as returned by getdirentries().
+ *
+ * The records are packed one after another, each d_reclen bytes
+ * long (a multiple of 4). d_name is NUL-terminated and the record
+ * only has room for the name actually there, so d_name is really
+ * variable-length; use d_reclen to step to the next record.
+ *
+ * Filesystems that can't tell give a d_ino of 0 and DT_UNKNOWN.
+ */
+struct dirent {
+	uint32_t d_ino;			/* inode number */
+	uint16_t d_reclen;		/* length of this record */
+	uint8_t d_type;			/* DT_* below */
+	uint8_t d_namlen;		/* strlen(d_name) */
+	char d_name[__NAME_MAX + 1];	/* name */
+};
+
+/* Size of the fixed part of a record, and of a whole one. */
+#define DIRENT_HDRSIZE		8
+#define DIRENT_RECLEN(namlen)	((DIRENT_HDRSIZE + (namlen) + 1 + 3) & ~3)
+
+/* Values for d_type */
+#define DT_UNKNOWN	0
+#define DT_REG		1
+#define DT_DIR		2
+#define DT_LNK		3
+
+#endif /* _KERN_DIRENT_H_ */
@@ -0,0 +1,27 @@
+/*
+ * Anonymous pipes.
+ */
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+
+struct vnode;
+
+/*
+ * Size of the in-kernel ring buffer of each pipe. Writers block
+ * when it is full and readers when it is empty.
+ */
+#define PIPE_SIZE 4096
+
+/*
+ * Create a pipe. On success hands back two vnodes, each with one
+ * reference: data written to *WRITEVN comes out of *READVN. Once
+ * every reference to the write end is gone readers get EOF; once
+ * every reference to the read end is gone writers get EPIPE. The
+ * pipe goes away when both ends have been released (vfs_close).
+ */
+int pipe_create(struct vnode **readvn, struct vnode **writevn);
+
+
+#endif /* _PIPE_H_ */
@@ -49,6 +49,7 @@
 struct addrspace;
 struct thread;
 struct vnode;
+struct fdtable;
 
 /*
  * Process structure.
@@ -86,7 +87,6 @@ struct arg_buf {
 
 #if OPT_FILESYSTEM
 #define SYSTEM_OPEN_MAX (10*OPEN_MAX)
-struct systemFileTable sysTable[SYSTEM_OPEN_MAX];
 #endif
 
 
@@ -108,7 +108,7 @@ struct proc {
 	#endif
 
 	#if OPT_FILESYSTEM
-	struct systemFileTable * openFileTable[OPEN_MAX];
+	struct fdtable * openFileTable;	/* fd -> systemFileTable (fdtable.h) */
 	#endif
 
 	#if OPT_FORK
@@ -148,7 +148,22 @@ struct proc *proc_search_pid(pid_t pid);
 
 void copyOpenFileTable(struct proc *parent, struct proc *child);
 
+#if OPT_FILESYSTEM
+/*
+ * Entries of the system open file table. systable_alloc returns a
+ * fresh entry for VN with one reference, or NULL if the table is
+ * full; systable_decref drops a reference and closes the vnode and
+ * recycles the entry when the last one goes away.
+ */
+struct systemFileTable *systable_alloc(struct vnode *vn, int openflag);
+void systable_incref(struct systemFileTable *sf);
+void systable_decref(struct systemFileTable *sf);
+#endif
+
 #if OPT_FORK
+/* Create the child process for fork(), sharing our fd table. */
+struct proc *proc_create_fork(const char *name);
+
 void add_child(struct proc *parent, struct proc *child);
 
 void remove_child(struct proc *parent, pid_t p_pid);
@@ -0,0 +1,41 @@
+/*
+ * Per-thread scratch arena for system call temporaries.
+ */
+
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+
+struct scratch_big;	/* private to scratch.c */
+
+/*
+ * Bump-pointer arena embedded in each thread. The arena page is
+ * allocated on first use and kept for the life of the thread;
+ * requests that don't fit in what is left of it are kmalloc'd and
+ * remembered instead. Nothing handed out is freed individually:
+ * everything goes away at once on scratch_reset(), which syscall()
+ * calls on the way out of every system call.
+ *
+ * Only the owning thread may touch its arena, so no locking is
+ * needed. Don't use it from interrupt handlers.
+ */
+struct scratch {
+	char *sc_base;			/* arena page, or NULL */
+	size_t sc_used;			/* bytes handed out from sc_base */
+	struct scratch_big *sc_big;	/* heap fallbacks to release */
+};
+
+#define SCRATCH_SIZE PAGE_SIZE
+
+/* Initialize and clean up a thread's arena. */
+void scratch_init(struct scratch *sc);
+void scratch_cleanup(struct scratch *sc);
+
+/* Get SZ bytes of scratch space for the current thread. */
+void *scratch_alloc(size_t sz);
+
+/* Release everything the current thread got from scratch_alloc. */
+void scratch_reset(void);
+
+
+#endif /* _SCRATCH_H_ */
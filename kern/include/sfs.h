@@ -42,20 +42,90 @@
 #include <fs.h>
 #include <vnode.h>
 
+struct lock;	/* from <synch.h> */
+struct sfs_dirindex;	/* private to sfs_dir.c */
+
 /*
  * Get on-disk structures and constants that are made available to
  * userland for the benefit of mksfs, dumpsfs, etc.
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * sv_lock covers one vnode: the in-memory inode (sv_i, sv_dirty, the
+ * readahead state) and the file's contents and block map (including
+ * the cached copy in sv_map), or for a directory its entries and
+ * their in-memory index. sfs_vnlock covers the table of loaded
+ * vnodes, and sfs_freemaplock the freemap with its bookkeeping (which
+ * blocks of it are loaded or need writing, and their free counts) and
+ * the superblock. sfs_dirtylock covers the list of vnodes with
+ * sv_dirty set; it can be taken under any of the others,
+ * and nothing else is locked while it's held. The block buffer cache
+ * does its own locking.
+ *
+ * Lock order:
+ *
+ *     vfs_biglock (held by some VFS-level callers; SFS never takes it)
+ *       -> directory sv_lock (parent before child)
+ *         -> file sv_lock
+ *           -> sfs_vnlock
+ *             -> sfs_freemaplock
+ *               -> buffers (see buf.h)
+ *
+ * One exception: a file's data or indirect block buffer may be held
+ * while taking sfs_freemaplock, because sfs_bmap allocates a block,
+ * and sfs_itrunc_indirect frees one, with the indirect block they
+ * are working on still owned. This can't deadlock, since holders of
+ * sfs_freemaplock only ever take freemap and superblock buffers,
+ * which are never held by anyone waiting for it.
+ *
+ * Every operation that holds a reference to a vnode may lock it; a
+ * vnode's lock must not be held while dropping what might be the
+ * last reference to it. sfs_reclaim does its work under sfs_vnlock
+ * alone, as nobody else can reach the vnode by then except through
+ * the table. The same goes for vnodes on the inactive list, which
+ * keep the reference sfs_reclaim was given.
+ */
+
+/*
+ * Number of chains in the hash table of loaded vnodes, by inode number.
+ */
+#define SFS_VNHASH_SIZE 64
+
+/*
+ * Number of unreferenced vnodes kept loaded in case they're wanted
+ * again. When the last reference to a vnode with links goes away it
+ * goes on the inactive list instead of being freed, and sfs_loadvnode
+ * takes it back off. The oldest ones are freed past this many, when
+ * memory runs short, and at unmount.
+ */
+#define SFS_INACTIVE_MAX 32
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* see above */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
-	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* sfs_vnhash chain (sfs_vnlock) */
+	unsigned sv_tableix;            /* index in sfs_vnodes (sfs_vnlock) */
+	bool sv_inactive;               /* on the inactive list (sfs_vnlock) */
+	struct sfs_vnode *sv_inactprev; /* inactive list (sfs_vnlock) */
+	struct sfs_vnode *sv_inactnext;
+	bool sv_dirty;                  /* sv_i modified; on the dirty list */
+	struct sfs_vnode *sv_dirtyprev; /* dirty list (sfs_dirtylock) */
+	struct sfs_vnode *sv_dirtynext;
+	struct sfs_dirindex *sv_dirindex; /* directory name index, or NULL */
+	uint32_t *sv_map;               /* copy of last leaf indirect block */
+	bool sv_mapvalid;               /* sv_map is up to date */
+	uint32_t sv_mapbase;            /* file block of sv_map[0] */
+	off_t sv_rapos;                 /* where the last read ended */
+	uint32_t sv_rawindow;           /* readahead window (blocks) */
+	uint32_t sv_raend;              /* 1st file block not prefetched */
 };
 
 /*
@@ -66,9 +136,20 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* same, by inode */
+	struct sfs_vnode *sfs_inacthead; /* inactive vnodes, oldest first */
+	struct sfs_vnode *sfs_inacttail;
+	unsigned sfs_ninactive;         /* number on the inactive list */
+	struct lock *sfs_dirtylock;     /* protects the dirty list */
+	struct sfs_vnode *sfs_dirtyhead; /* vnodes with sv_dirty set */
+	struct sfs_vnode *sfs_dirtytail;
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	struct bitmap *sfs_freemaploaded; /* freemap blocks read in */
+	uint16_t *sfs_freecount;        /* free blocks per freemap block */
 };
 
 /*
@@ -78,6 +78,11 @@ int sys_fork(struct trapframe *ctf, pid_t *retval);
 #if OPT_FILESYSTEM
 int sys_open(userptr_t fd, int openflag, mode_t mode, int *errp);
 int sys_close(int fd);
+int sys_pipe(userptr_t fds, int *retval);
+int sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t pos, int * retval);
+int sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t pos, int * retval);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int * retval);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int * retval);
 #endif
 
 #if OPT_SHELL
@@ -85,6 +90,8 @@ int sys_lseek(int fd, off_t pos, int whence, int32_t * ret_low, int32_t * ret_up
 int sys_dup2(int oldfd, int newfd);
 int sys_chdir(const char *pathname);
 int sys__getcwd(char *buf, size_t buflen, int * retval);
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, userptr_t cookiep,
+                      int * retval);
 int sys_execv(const char *program, char * args[]);
 
 #endif
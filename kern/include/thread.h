@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <scratch.h>
 
 struct cpu;
 
@@ -106,6 +107,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	struct scratch t_scratch;	/* Syscall temporaries (scratch.h) */
+
 	/* add more here as needed */
 };
 
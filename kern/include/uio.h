@@ -138,5 +138,13 @@ int uiomovezeros(size_t len, struct uio *uio);
 void uio_kinit(struct iovec *, struct uio *,
 	       void *kbuf, size_t len, off_t pos, enum uio_rw rw);
 
+/*
+ * Initialize a uio for I/O straight to or from a user buffer in the
+ * current process, with no intermediate kernel copy. Faults on the
+ * user buffer come back from uiomove as EFAULT.
+ */
+void uio_uinit(struct iovec *, struct uio *,
+	       userptr_t ubuf, size_t len, off_t pos, enum uio_rw rw);
+
 
 #endif /* _UIO_H_ */
@@ -52,6 +52,7 @@ struct systemFileTable {
     int mode_open;              /* Define the opening mode for the current file   */
     unsigned int count_refs;    /* Count the number of processes which have currently opened this file                  */
     struct lock *lock;          /* Define the lock for this open file                                                   */
+    struct systemFileTable *next_free; /* Next entry on the free list (only while unused)                               */
 };
 
 /*
@@ -89,6 +90,32 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Lookup cache used by vfs_lookup (vfsdcache.c).
+ *
+ *    vfs_dcache_lookup     - Find a cached result for NAME relative to
+ *                            DIR; *RET is NULL if it doesn't exist.
+ *    vfs_dcache_getgen     - Get the generation of DIR's filesystem to
+ *                            pass to enter.
+ *    vfs_dcache_enter      - Cache a VOP_LOOKUP result (NULL for ENOENT),
+ *                            unless FS was invalidated since GEN.
+ *    vfs_dcache_invalidate - Drop all entries for FS (NULL for vnodes
+ *                            not on a filesystem). Must be called after
+ *                            anything that removes or renames names on
+ *                            FS, and before unmount.
+ *    vfs_dcache_invalidate_negative
+ *                          - Drop only the ENOENT entries for FS. Enough
+ *                            after anything that only adds names.
+ */
+
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret);
+unsigned vfs_dcache_getgen(struct vnode *dir);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_dcache_invalidate(struct fs *fs);
+void vfs_dcache_invalidate_negative(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -128,6 +155,8 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_bootstrap - Call during system initialization to allocate
  *                    structures.
  *
+ *    vfs_dcache_bootstrap - Set up the lookup cache (from vfs_bootstrap).
+ *
  *    vfs_setbootfs - Set the filesystem that paths beginning with a
  *                    slash are sent to. If not set, these paths fail
  *                    with ENOENT. The argument should be the device
@@ -175,6 +204,7 @@ int vfs_getcwd(struct uio *buf);
  */
 
 void vfs_bootstrap(void);
+void vfs_dcache_bootstrap(void);
 
 int vfs_setbootfs(const char *fsname);
 void vfs_clearbootfs(void);
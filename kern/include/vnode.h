@@ -98,6 +98,19 @@ struct vnode {
  *                      handled in the normal fashion.
  *                      On non-directory objects, return ENOTDIR.
  *
+ *    vop_getdirentries - Read as many entries from a directory as fit
+ *                      into a uio, as struct dirent records (see
+ *                      kern/dirent.h), starting at the position in
+ *                      the offset field and updating it to where the
+ *                      next call should carry on. As with
+ *                      vop_getdirentry the offset is a cookie, not a
+ *                      byte count. Returns 0 with nothing transferred
+ *                      at the end of the directory, and EINVAL if the
+ *                      next record doesn't fit at all. Filesystems
+ *                      without anything better can use
+ *                      vfs_getdirentries_byname.
+ *                      On non-directory objects, return ENOTDIR.
+ *
  *    vop_write       - Write data from uio to file at offset specified
  *                      in the uio, updating uio_resid to reflect the
  *                      amount written, and updating uio_offset to match.
@@ -187,6 +200,7 @@ struct vnode_ops {
 	int (*vop_read)(struct vnode *file, struct uio *uio);
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
+	int (*vop_getdirentries)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
@@ -231,6 +245,7 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
+#define VOP_GETDIRENTRIES(vn, uio)      (__VOP(vn,getdirentries)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
@@ -279,6 +294,19 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * Helpers for vop_getdirentries (in vfs/vfsdirent.c):
+ *
+ *     vfs_dirent_emit           - add one record to the uio; ENOSPC if
+ *                                 it doesn't fit.
+ *     vfs_getdirentries_byname  - vop_getdirentries done with one
+ *                                 vop_getdirentry per name, for
+ *                                 filesystems that only have that.
+ */
+int vfs_dirent_emit(struct uio *uio, uint32_t ino, unsigned type,
+		    const char *name);
+int vfs_getdirentries_byname(struct vnode *dir, struct uio *uio);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
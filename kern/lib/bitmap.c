@@ -47,8 +47,21 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * Searches still skip over full stretches of the map a uint32_t at a
+ * time; "all ones" reads the same in either byte order.
+ */
+#define CHUNK_WORDS     (sizeof(uint32_t) / sizeof(WORD_TYPE))
+#define CHUNK_ALLBITS   (0xffffffff)
+
+/*
+ * lowfree is a search cursor: every word below it is known to be
+ * full. It only moves down when a bit is cleared, so bitmap_alloc
+ * can start there and still hand out the lowest free bit.
+ */
 struct bitmap {
         unsigned nbits;
+        unsigned lowfree;
         WORD_TYPE *v;
 };
 
@@ -72,6 +85,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->lowfree = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -95,31 +109,192 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Number of trailing zero bits in X, which must not be 0.
+ */
+static
+inline
+unsigned
+bitmap_ctz(unsigned x)
+{
+        unsigned n = 0;
+
+        KASSERT(x != 0);
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+}
+
+/*
+ * Find the first clear bit in [START, END) and return its index.
+ * Full words are skipped CHUNK_WORDS at a time once aligned, and the
+ * bit within a word is found with ctz rather than bit by bit.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned end,
+                unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned ix, maxix;
+        uint32_t chunk;
+        WORD_TYPE w;
+
+        if (start >= end) {
+                return ENOSPC;
+        }
+        ix = start / BITS_PER_WORD;
+        maxix = DIVROUNDUP(end, BITS_PER_WORD);
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+        /* Bits below START in the first word count as taken. */
+        w = b->v[ix] | (WORD_TYPE)((1U << (start % BITS_PER_WORD)) - 1);
+        while (w == WORD_ALLBITS) {
+                ix++;
+                while (ix % CHUNK_WORDS == 0 && ix + CHUNK_WORDS <= maxix) {
+                        memcpy(&chunk, &b->v[ix], sizeof(chunk));
+                        if (chunk != CHUNK_ALLBITS) {
+                                break;
                         }
-                        KASSERT(0);
+                        ix += CHUNK_WORDS;
+                }
+                if (ix >= maxix) {
+                        return ENOSPC;
                 }
+                w = b->v[ix];
+        }
+
+        *index = ix*BITS_PER_WORD + bitmap_ctz((WORD_TYPE)~w);
+        if (*index >= end) {
+                return ENOSPC;
+        }
+        return 0;
+}
+
+/*
+ * Find LEN clear bits in a row within [START, END).
+ */
+static
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned end,
+               unsigned len, unsigned *index)
+{
+        unsigned pos, runstart, i;
+        int result;
+
+        pos = start;
+        while (pos + len <= end) {
+                /* Jump to the next clear bit... */
+                result = bitmap_findzero(b, pos, end, &runstart);
+                if (result) {
+                        return result;
+                }
+                if (runstart + len > end) {
+                        return ENOSPC;
+                }
+                /* ...and see how far the run goes. */
+                for (i = 1; i < len; i++) {
+                        if (bitmap_isset(b, runstart + i)) {
+                                break;
+                        }
+                }
+                if (i == len) {
+                        *index = runstart;
+                        return 0;
+                }
+                pos = runstart + i + 1;
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_findzero(b, b->lowfree * BITS_PER_WORD, b->nbits,
+                                 index);
+        if (result) {
+                b->lowfree = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+                return result;
+        }
+        b->lowfree = *index / BITS_PER_WORD;
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        int result;
+
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        result = bitmap_findzero(b, hint, b->nbits, index);
+        if (result) {
+                result = bitmap_findzero(b, b->lowfree * BITS_PER_WORD,
+                                         hint, index);
+                if (result) {
+                        return result;
+                }
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_find_run(struct bitmap *b, unsigned hint, unsigned len,
+                unsigned *index)
+{
+        int result;
+
+        KASSERT(len > 0);
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        result = bitmap_findrun(b, hint, b->nbits, len, index);
+        if (result && hint > 0) {
+                /* Wrap around; the run may end past HINT. */
+                result = bitmap_findrun(b, 0, hint + len - 1 < b->nbits ?
+                                        hint + len - 1 : b->nbits,
+                                        len, index);
+        }
+        return result;
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned hint, unsigned len,
+                   unsigned *index)
+{
+        unsigned i;
+        int result;
+
+        result = bitmap_find_run(b, hint, len, index);
+        if (result) {
+                return result;
+        }
+        for (i = 0; i < len; i++) {
+                bitmap_mark(b, *index + i);
+        }
+        return 0;
+}
+
 static
 inline
 void
@@ -131,6 +306,15 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+void
+bitmap_rescan(struct bitmap *b, unsigned index)
+{
+        KASSERT(index < b->nbits);
+        if (index / BITS_PER_WORD < b->lowfree) {
+                b->lowfree = index / BITS_PER_WORD;
+        }
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
@@ -155,6 +339,9 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        if (ix < b->lowfree) {
+                b->lowfree = ix;
+        }
 }
 
 
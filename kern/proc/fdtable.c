@@ -0,0 +1,264 @@
+/*
+ * Per-process file descriptor table. See fdtable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <vfs.h>
+#include <proc.h>
+#include <fdtable.h>
+
+struct fdtable *
+fdtable_create(void)
+{
+	struct fdtable *ft;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	ft->ft_used = bitmap_create(FDTABLE_INLINE);
+	if (ft->ft_used == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+	bzero(ft->ft_inline, sizeof(ft->ft_inline));
+	ft->ft_files = ft->ft_inline;
+	ft->ft_size = FDTABLE_INLINE;
+	ft->ft_refcount = 1;
+	spinlock_init(&ft->ft_lock);
+	return ft;
+}
+
+/*
+ * Free a table. The open files must already have been dealt with.
+ */
+static
+void
+fdtable_destroy(struct fdtable *ft)
+{
+	if (ft->ft_files != ft->ft_inline) {
+		kfree(ft->ft_files);
+	}
+	bitmap_destroy(ft->ft_used);
+	spinlock_cleanup(&ft->ft_lock);
+	kfree(ft);
+}
+
+void
+fdtable_incref(struct fdtable *ft)
+{
+	spinlock_acquire(&ft->ft_lock);
+	KASSERT(ft->ft_refcount > 0);
+	ft->ft_refcount++;
+	spinlock_release(&ft->ft_lock);
+}
+
+void
+fdtable_decref(struct fdtable *ft)
+{
+	struct systemFileTable *sf;
+	unsigned last, i;
+
+	spinlock_acquire(&ft->ft_lock);
+	KASSERT(ft->ft_refcount > 0);
+	ft->ft_refcount--;
+	last = (ft->ft_refcount == 0);
+	spinlock_release(&ft->ft_lock);
+
+	if (!last) {
+		return;
+	}
+
+	for (i=0; i<ft->ft_size; i++) {
+		sf = ft->ft_files[i];
+		if (sf != NULL) {
+			ft->ft_files[i] = NULL;
+			systable_decref(sf);
+		}
+	}
+	fdtable_destroy(ft);
+}
+
+/*
+ * Grow the table so it has at least MINSIZE slots.
+ */
+static
+int
+fdtable_grow(struct fdtable *ft, unsigned minsize)
+{
+	struct systemFileTable **newfiles;
+	struct bitmap *newused;
+	unsigned newsize;
+
+	KASSERT(minsize <= FD_MAX);
+
+	newsize = ft->ft_size;
+	while (newsize < minsize) {
+		newsize *= 2;
+	}
+	if (newsize > FD_MAX) {
+		newsize = FD_MAX;
+	}
+
+	newfiles = kmalloc(newsize * sizeof(*newfiles));
+	if (newfiles == NULL) {
+		return ENOMEM;
+	}
+	newused = bitmap_create(newsize);
+	if (newused == NULL) {
+		kfree(newfiles);
+		return ENOMEM;
+	}
+
+	/* sizes are multiples of 8, so the bitmap copies bytewise */
+	COMPILE_ASSERT(FDTABLE_INLINE % 8 == 0);
+	memcpy(bitmap_getdata(newused), bitmap_getdata(ft->ft_used),
+	       ft->ft_size / 8);
+	memcpy(newfiles, ft->ft_files, ft->ft_size * sizeof(*newfiles));
+	bzero(newfiles + ft->ft_size,
+	      (newsize - ft->ft_size) * sizeof(*newfiles));
+
+	if (ft->ft_files != ft->ft_inline) {
+		kfree(ft->ft_files);
+	}
+	bitmap_destroy(ft->ft_used);
+	ft->ft_files = newfiles;
+	ft->ft_used = newused;
+	ft->ft_size = newsize;
+	return 0;
+}
+
+struct systemFileTable *
+fdtable_get(struct fdtable *ft, int fd)
+{
+	if (fd < 0 || (unsigned)fd >= ft->ft_size) {
+		return NULL;
+	}
+	return ft->ft_files[fd];
+}
+
+int
+fdtable_alloc(struct fdtable *ft, struct systemFileTable *sf, int *fd)
+{
+	unsigned index;
+	int result;
+
+	KASSERT(sf != NULL);
+
+	if (bitmap_alloc(ft->ft_used, &index)) {
+		/* full; the first free fd is the first new slot */
+		if (ft->ft_size >= FD_MAX) {
+			return EMFILE;
+		}
+		index = ft->ft_size;
+		result = fdtable_grow(ft, index + 1);
+		if (result) {
+			return result;
+		}
+		bitmap_mark(ft->ft_used, index);
+	}
+
+	KASSERT(ft->ft_files[index] == NULL);
+	ft->ft_files[index] = sf;
+	*fd = index;
+	return 0;
+}
+
+int
+fdtable_place(struct fdtable *ft, int fd, struct systemFileTable *sf)
+{
+	int result;
+
+	KASSERT(sf != NULL);
+
+	if (fd < 0 || fd >= FD_MAX) {
+		return EBADF;
+	}
+	if ((unsigned)fd >= ft->ft_size) {
+		result = fdtable_grow(ft, fd + 1);
+		if (result) {
+			return result;
+		}
+	}
+
+	KASSERT(ft->ft_files[fd] == NULL);
+	bitmap_mark(ft->ft_used, fd);
+	ft->ft_files[fd] = sf;
+	return 0;
+}
+
+struct systemFileTable *
+fdtable_remove(struct fdtable *ft, int fd)
+{
+	struct systemFileTable *sf;
+
+	sf = fdtable_get(ft, fd);
+	if (sf != NULL) {
+		bitmap_unmark(ft->ft_used, fd);
+		ft->ft_files[fd] = NULL;
+	}
+	return sf;
+}
+
+/*
+ * Make a private copy of a table, taking a reference on each open
+ * file in it.
+ */
+static
+struct fdtable *
+fdtable_copy(struct fdtable *ft)
+{
+	struct fdtable *copy;
+	unsigned i;
+
+	copy = fdtable_create();
+	if (copy == NULL) {
+		return NULL;
+	}
+	if (ft->ft_size > copy->ft_size) {
+		if (fdtable_grow(copy, ft->ft_size)) {
+			fdtable_destroy(copy);
+			return NULL;
+		}
+	}
+	KASSERT(copy->ft_size == ft->ft_size);
+
+	memcpy(bitmap_getdata(copy->ft_used), bitmap_getdata(ft->ft_used),
+	       DIVROUNDUP(ft->ft_size, 8));
+	memcpy(copy->ft_files, ft->ft_files,
+	       ft->ft_size * sizeof(*ft->ft_files));
+	for (i=0; i<copy->ft_size; i++) {
+		if (copy->ft_files[i] != NULL) {
+			systable_incref(copy->ft_files[i]);
+		}
+	}
+	return copy;
+}
+
+int
+fdtable_unshare(struct fdtable **ftp)
+{
+	struct fdtable *ft = *ftp;
+	struct fdtable *copy;
+	bool shared;
+
+	spinlock_acquire(&ft->ft_lock);
+	shared = (ft->ft_refcount > 1);
+	spinlock_release(&ft->ft_lock);
+
+	if (!shared) {
+		return 0;
+	}
+
+	copy = fdtable_copy(ft);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+	*ftp = copy;
+	/* might turn out to be the last reference, if the others let go */
+	fdtable_decref(ft);
+	return 0;
+}
@@ -51,6 +51,9 @@
 #include "limits.h"
 #include <kern/fcntl.h>
 #include <copyinout.h>
+#if OPT_FILESYSTEM
+#include <fdtable.h>
+#endif
 
 
 #if OPT_WAITPID
@@ -127,12 +130,122 @@ proc_init_waitpid(struct proc *proc, const char *name)
 #endif
 }
 
+#if OPT_FILESYSTEM
+// tabella di sistema dei file aperti
+// le entry libere stanno in una free list protetta da uno spinlock,
+// quindi allocare/liberare una entry è O(1) e sicuro anche su SMP.
+// Il lock di ogni entry viene creato al primo utilizzo e poi riusato.
+static struct _sysTable
+{
+	struct systemFileTable entries[SYSTEM_OPEN_MAX];
+	struct systemFileTable *freelist; /* entry libere */
+	struct spinlock lk;				  /* Lock for the free list */
+} sysTable;
+
+static void
+systable_bootstrap(void)
+{
+	int i;
+
+	spinlock_init(&sysTable.lk);
+	sysTable.freelist = NULL;
+	// la free list parte dalla entry 0
+	for (i = SYSTEM_OPEN_MAX - 1; i >= 0; i--)
+	{
+		sysTable.entries[i].vn = NULL;
+		sysTable.entries[i].lock = NULL;
+		sysTable.entries[i].next_free = sysTable.freelist;
+		sysTable.freelist = &sysTable.entries[i];
+	}
+}
+
+// rimette una entry (già senza vnode) nella free list
+static void
+systable_put(struct systemFileTable *sf)
+{
+	KASSERT(sf->vn == NULL);
+
+	spinlock_acquire(&sysTable.lk);
+	sf->next_free = sysTable.freelist;
+	sysTable.freelist = sf;
+	spinlock_release(&sysTable.lk);
+}
+
+struct systemFileTable *
+systable_alloc(struct vnode *vn, int openflag)
+{
+	struct systemFileTable *sf;
+
+	spinlock_acquire(&sysTable.lk);
+	sf = sysTable.freelist;
+	if (sf != NULL)
+	{
+		sysTable.freelist = sf->next_free;
+	}
+	spinlock_release(&sysTable.lk);
+
+	if (sf == NULL)
+	{
+		return NULL;
+	}
+
+	// la prima volta che la entry viene usata creiamo il suo lock
+	if (sf->lock == NULL)
+	{
+		sf->lock = lock_create("FILE_LOCK");
+		if (sf->lock == NULL)
+		{
+			systable_put(sf);
+			return NULL;
+		}
+	}
+
+	sf->next_free = NULL;
+	sf->vn = vn;
+	sf->offset = 0;
+	sf->mode_open = openflag;
+	sf->count_refs = 1;
+	return sf;
+}
+
+void
+systable_incref(struct systemFileTable *sf)
+{
+	lock_acquire(sf->lock);
+	KASSERT(sf->count_refs > 0);
+	sf->count_refs++;
+	lock_release(sf->lock);
+}
+
+void
+systable_decref(struct systemFileTable *sf)
+{
+	struct vnode *vn = NULL;
+
+	lock_acquire(sf->lock);
+	KASSERT(sf->count_refs > 0);
+	sf->count_refs--;
+	if (sf->count_refs == 0)
+	{
+		vn = sf->vn;
+		sf->vn = NULL;
+	}
+	lock_release(sf->lock);
+
+	// ultimo riferimento: chiudiamo il file e ricicliamo la entry
+	if (vn != NULL)
+	{
+		vfs_close(vn);
+		systable_put(sf);
+	}
+}
+
 // ci inserisce gli stdin, stdout, stderr come se fossero dei file descriptor
-static int insert_standard(const char * path, int fd, int openflag, struct proc * p)
+static int insert_standard(int fd, int openflag, struct proc * p)
 {
 	int result;
 	struct vnode *v;
-	struct systemFileTable *st = NULL;
+	struct systemFileTable *st;
 
 	char * console = kstrdup("con:");
 
@@ -142,28 +255,22 @@ static int insert_standard(const char * path, int fd, int openflag, struct proc
 
 	if (result) return -1;
 	
-	// cerchiamo in systemFileTable
-	// va ad inserire il vnode nella systable alla prima posizione libera
-	for (int i = 0; i < SYSTEM_OPEN_MAX; i++){
-		if (sysTable[i].vn == NULL){
-			sysTable[i].vn = v;
-			st = &sysTable[i];
-			break;
-		}
-	}
-
+	// prendiamo una entry libera della systemFileTable
+	st = systable_alloc(v, openflag);
 	if (st == NULL)
 	{
 		vfs_close(v);
 		return -1;
 	}
-	p->openFileTable[fd] = st; // openFileTable è un puntatore alla SystemFileTable
-	st->offset = 0;
-	st->mode_open = openflag;
-	st->count_refs = 1;
-	st->lock = lock_create(path);
+	// openFileTable punta alla SystemFileTable
+	if (fdtable_place(p->openFileTable, fd, st))
+	{
+		systable_decref(st);
+		return -1;
+	}
 	return 0;
 }
+#endif
 
 static void
 proc_end_waitpid(struct proc *proc)
@@ -215,7 +322,8 @@ proc_create(const char *name)
 	proc_init_waitpid(proc, name);
 
 #if OPT_FILESYSTEM
-	bzero(proc->openFileTable, OPEN_MAX * sizeof(struct systemFileTable *));
+	// la tabella dei fd viene creata (o condivisa) da chi crea il processo
+	proc->openFileTable = NULL;
 #endif
 
 #if OPT_FORK
@@ -313,6 +421,15 @@ void proc_destroy(struct proc *proc)
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
 
+#if OPT_FILESYSTEM
+	// rilascia la tabella dei fd; se era l'ultimo a usarla chiude i file
+	if (proc->openFileTable != NULL)
+	{
+		fdtable_decref(proc->openFileTable);
+		proc->openFileTable = NULL;
+	}
+#endif
+
 	proc_end_waitpid(proc);
 
 // Facciamo la free della lista dei processi figli
@@ -357,6 +474,9 @@ void proc_bootstrap(void)
 	/* kernel process is not registered in the table */
 	processTable.active = 1;
 #endif
+#if OPT_FILESYSTEM
+	systable_bootstrap();
+#endif
 }
 
 /*
@@ -396,15 +516,54 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&curproc->p_lock);
 
 	#if OPT_FILESYSTEM
+	newproc->openFileTable = fdtable_create();
+	if (newproc->openFileTable == NULL)
+	{
+		proc_destroy(newproc);
+		return NULL;
+	}
+
 	// creo subito i vnode 0, 1, 2 per lo stdin, stodout, stderr
-	if(insert_standard("STDIN", 0, O_RDONLY, newproc) == -1) return NULL;
-	if(insert_standard("STDOUT",1, O_WRONLY, newproc) == -1) return NULL;
-	if(insert_standard("STDERR",2, O_WRONLY, newproc) == -1) return NULL;
+	if(insert_standard(0, O_RDONLY, newproc) == -1) return NULL;
+	if(insert_standard(1, O_WRONLY, newproc) == -1) return NULL;
+	if(insert_standard(2, O_WRONLY, newproc) == -1) return NULL;
 	#endif
 
 	return newproc;
 }
 
+#if OPT_FORK
+/*
+ * Create a proc for the child of sys_fork. Like
+ * proc_create_runprogram, but rather than opening the console the
+ * child shares the parent's (that is, the current process's) fd
+ * table.
+ */
+struct proc *
+proc_create_fork(const char *name)
+{
+	struct proc *newproc;
+
+	newproc = proc_create(name);
+	if (newproc == NULL)
+	{
+		return NULL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	if (curproc->p_cwd != NULL)
+	{
+		VOP_INCREF(curproc->p_cwd);
+		newproc->p_cwd = curproc->p_cwd;
+	}
+	spinlock_release(&curproc->p_lock);
+
+	copyOpenFileTable(curproc, newproc);
+
+	return newproc;
+}
+#endif
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -523,12 +682,18 @@ int proc_wait(struct proc *proc)
 #endif
 }
 
-// dobbiamo copiare la open file table del vecchio processo nel nuovo
+// la open file table del padre viene condivisa dal figlio (copy-on-write):
+// la copia vera si fa solo quando uno dei due la modifica (fdtable_unshare)
 void copyOpenFileTable(struct proc *parent, struct proc *child)
 {
-	for (int i = 0; i < OPEN_MAX; i++){
-		child->openFileTable[i] = parent->openFileTable[i];
-	}
+#if OPT_FILESYSTEM
+	KASSERT(child->openFileTable == NULL);
+	fdtable_incref(parent->openFileTable);
+	child->openFileTable = parent->openFileTable;
+#else
+	(void)parent;
+	(void)child;
+#endif
 }
 
 #if OPT_FORK
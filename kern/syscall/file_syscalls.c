@@ -17,6 +17,7 @@
 #include <proc.h>
 #include <kern/fcntl.h>
 #include <kern/types.h>
+#include <scratch.h>
 #if OPT_SHELL
 #include <kern/seek.h>
 #include <kern/stat.h>
@@ -29,111 +30,201 @@
   #include <proc.h>
   #include <synch.h>
   #include <copyinout.h>
+  #include <fdtable.h>
+  #include <pipe.h>
 #endif
 
 
 #if OPT_FILESYSTEM
- //file read - write con buffer kernel 
- static int
-file_read(int fd, userptr_t buf_ptr, size_t size, int * retval) {
-  struct iovec iov;
-  struct uio ku;
-  int result, nread;
-  struct vnode *vn;
+ //file read - write direttamente sul buffer utente (niente copia nel kernel)
+
+//controlli comuni: fd valido e aperto nel modo giusto per la direzione rw
+static int
+file_get(int fd, enum uio_rw rw, struct systemFileTable **ret) {
   struct systemFileTable *sf;
-  void *kbuf;
-  int err;
+  int accmode;
 
-  if(fd<0 || fd>OPEN_MAX || curproc->openFileTable[fd]==NULL){
+  sf = fdtable_get(curproc->openFileTable, fd);
+  if(sf == NULL){
     return EBADF;
   }
 
-  if(buf_ptr == NULL){
-    return EFAULT;
+  accmode = sf->mode_open & O_ACCMODE;
+  if (rw == UIO_READ && accmode == O_WRONLY) return EBADF;
+  if (rw == UIO_WRITE && accmode == O_RDONLY) return EBADF;
+  if (sf->vn==NULL) return EBADF;
+
+  *ret = sf;
+  return 0;
+}
+
+//VOP_READ / VOP_WRITE a seconda della direzione della uio
+static int
+file_vop(struct vnode *vn, struct uio *u) {
+  if (u->uio_rw == UIO_READ) {
+    return VOP_READ(vn, u);   //copia direttamente in user space
   }
-  
-  sf = curproc->openFileTable[fd];
-  if (sf->mode_open == O_WRONLY) return EBADF;
-  vn = sf->vn;
-  if (vn==NULL) return -1;
-  
+  return VOP_WRITE(vn, u);    //legge direttamente dal buffer utente
+}
+
+ //la uio (anche con più iovec) è già pronta, qui si prende solo la entry
+ //della system table e si fa l'I/O con un solo lock_acquire
+static int
+file_io(int fd, struct uio *u, int * retval) {
+  int result;
+  size_t len;
+  struct systemFileTable *sf;
+
+  result = file_get(fd, u->uio_rw, &sf);
+  if (result) return result;
+
   lock_acquire(sf->lock);
 
-  kbuf = kmalloc(size);
-  uio_kinit(&iov, &ku, kbuf, size, sf->offset, UIO_READ);
-  result = VOP_READ(vn, &ku);
-  
+  u->uio_offset = sf->offset;
+  len = u->uio_resid;
+  result = file_vop(sf->vn, u);
   if (result) {
     lock_release(sf->lock);
-    return EIO;
+    return result;
   }
 
-  sf->offset = ku.uio_offset;
-  nread = size - ku.uio_resid;
+  sf->offset = u->uio_offset;
+  lock_release(sf->lock);
 
-  if (nread == 0){
-    *retval = 0; //EOF
-    kfree(kbuf);
-    lock_release(sf->lock);
-    return 0;
-  }
-  
+  *retval = len - u->uio_resid; //0 in lettura --> EOF
+  return 0;
+}
 
-  err = copyout(kbuf,buf_ptr,nread);
-  if(err){
-    kfree(kbuf);
-    lock_release(sf->lock);
-    return EFAULT;
+//I/O posizionale: l'offset arriva dal chiamante e sf->offset non si tocca,
+//quindi non serve sf->lock (la serializzazione la fa il filesystem)
+static int
+file_pio(int fd, struct uio *u, int * retval) {
+  int result;
+  size_t len;
+  struct systemFileTable *sf;
+
+  result = file_get(fd, u->uio_rw, &sf);
+  if (result) return result;
+
+  if (!VOP_ISSEEKABLE(sf->vn)) {
+    return ESPIPE;
+  }
+  if (u->uio_offset < 0) {
+    return EINVAL;
   }
 
-  kfree(kbuf);
-  lock_release(sf->lock);
+  len = u->uio_resid;
+  result = file_vop(sf->vn, u);
+  if (result) return result;
 
-  *retval = nread;
+  *retval = len - u->uio_resid;
   return 0;
 }
 
+static int
+file_read(int fd, userptr_t buf_ptr, size_t size, int * retval) {
+  struct iovec iov;
+  struct uio u;
+
+  if(buf_ptr == NULL){
+    return EFAULT;
+  }
+
+  uio_uinit(&iov, &u, buf_ptr, size, 0, UIO_READ);
+  return file_io(fd, &u, retval);
+}
 
 static int
 file_write(int fd, userptr_t buf_ptr, size_t size, int * retval) {
   struct iovec iov;
-  struct uio ku;
-  int result, nwrite;
-  struct vnode *vn;
-  struct systemFileTable *sf;
-  void *kbuf;
-
-  if (fd<0||fd>OPEN_MAX) 
-    return EBADF;
+  struct uio u;
 
   if(buf_ptr == NULL)
     return EFAULT;
-    
 
-  sf = curproc->openFileTable[fd];
-  if (sf==NULL || sf->mode_open == O_RDONLY) return EBADF;
+  uio_uinit(&iov, &u, buf_ptr, size, 0, UIO_WRITE);
+  return file_io(fd, &u, retval);
+}
 
-  vn = sf->vn;
-  if (vn==NULL) return EBADF;
+//readv/writev: copiamo solo il vettore di iovec nel kernel (scratch area),
+//i dati passano direttamente tra i buffer utente e il vnode
+static int
+file_iov(int fd, userptr_t uiov, int iovcnt, enum uio_rw rw, int * retval) {
+  struct iovec *iov;
+  struct uio u;
+  size_t total;
+  int result, i;
 
-  lock_acquire(sf->lock);
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (uiov == NULL) {
+    return EFAULT;
+  }
 
-  kbuf = kmalloc(size);
-  copyin(buf_ptr,kbuf,size);
-  uio_kinit(&iov, &ku, kbuf, size, sf->offset, UIO_WRITE);
-  result = VOP_WRITE(vn, &ku);
+  iov = scratch_alloc(iovcnt * sizeof(struct iovec));
+  if (iov == NULL) {
+    return ENOMEM;
+  }
+  result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
   if (result) {
-    lock_release(sf->lock);
-    return EFBIG;
+    return result;
+  }
+
+  //il totale deve stare nel valore di ritorno (int)
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > 0x7fffffff - total) {
+      return EINVAL;
+    }
+    total += iov[i].iov_len;
   }
 
-  kfree(kbuf);
-  sf->offset = ku.uio_offset;
-  nwrite = size - ku.uio_resid;
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = 0;
+  u.uio_resid = total;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = proc_getas();
 
-  lock_release(sf->lock);
-  *retval = nwrite;
-  return 0;
+  return file_io(fd, &u, retval);
+}
+
+int
+sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t pos, int * retval) {
+  struct iovec iov;
+  struct uio u;
+
+  if(buf_ptr == NULL){
+    return EFAULT;
+  }
+
+  uio_uinit(&iov, &u, buf_ptr, size, pos, UIO_READ);
+  return file_pio(fd, &u, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t pos, int * retval) {
+  struct iovec iov;
+  struct uio u;
+
+  if(buf_ptr == NULL){
+    return EFAULT;
+  }
+
+  uio_uinit(&iov, &u, buf_ptr, size, pos, UIO_WRITE);
+  return file_pio(fd, &u, retval);
+}
+
+int
+sys_readv(int fd, userptr_t iov, int iovcnt, int * retval) {
+  return file_iov(fd, iov, iovcnt, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, userptr_t iov, int iovcnt, int * retval) {
+  return file_iov(fd, iov, iovcnt, UIO_WRITE, retval);
 }
 #endif
 
@@ -183,7 +274,7 @@ sys_read(int fd, userptr_t buf_ptr, size_t size, int* retval){
 #if OPT_FILESYSTEM
 
 int sys_open(userptr_t path, int openflag, mode_t mode, int *errp){
-  int result;
+  int result, fd;
   struct vnode * v;
   struct systemFileTable *st = NULL;
   int flag = openflag & O_ACCMODE;
@@ -205,69 +296,104 @@ int sys_open(userptr_t path, int openflag, mode_t mode, int *errp){
     return -1;
   }
 
-  //cerchiamo in systemFileTable
-  //va ad inserire il vnode nella systable alla prima posizione libera
-  
-  for(int i = 0; i < SYSTEM_OPEN_MAX; i++){
-    if(sysTable[i].vn == NULL){
-      sysTable[i].vn = v;
-      st = &sysTable[i];
-      break;
-    }
-  }
-  
+  //prendiamo una entry libera della systemFileTable (free list, O(1))
+  st = systable_alloc(v, openflag);
   if(st == NULL){
     *errp = ENFILE;
     vfs_close(v);
     return -1;
   }
 
-  //search in File Table
-  //partiamo dal primo indice disponibile come fd
-  for(int i = 3; i < OPEN_MAX; i++){
-    if(curproc->openFileTable[i] == NULL){
-      curproc->openFileTable[i] = st; //openFileTable è un puntatore alla SystemFileTable 
-      st->offset = 0;
-      st->mode_open = openflag;
-      st->count_refs = 1;
-      st->lock = lock_create("FILE_LOCK");
-      return i; //questo i diventa identificatore del file per il processo
-    }
+  //se la File Table è condivisa con padre/figli ce ne facciamo una copia
+  result = fdtable_unshare(&curproc->openFileTable);
+  if(result){
+    systable_decref(st);
+    *errp = result;
+    return -1;
+  }
+
+  //il fd è il più basso libero (bitmap della File Table)
+  result = fdtable_alloc(curproc->openFileTable, st, &fd);
+  if(result){
+    //non ci sono fd liberi
+    //(systable_decref chiude il vnode e libera la entry)
+    systable_decref(st);
+    *errp = result;
+    return -1;
   }
 
-  //se arriviamo qua non ci sono entry libere
-  st->vn = NULL;
-  *errp = EMFILE;
-  vfs_close(v);
-  return -1;
+  return fd; //questo fd diventa identificatore del file per il processo
 }
 
 int sys_close(int fd){
-  if(fd < 0 || fd > OPEN_MAX) return EBADF;
+  int err;
 
+  if(fdtable_get(curproc->openFileTable, fd) == NULL) return EBADF;
 
-  struct systemFileTable * sf = curproc->openFileTable[fd];
-  if(sf == NULL) return EBADF;
+  //la File Table potrebbe essere condivisa dopo una fork
+  err = fdtable_unshare(&curproc->openFileTable);
+  if(err) return err;
 
+  struct systemFileTable * sf = fdtable_remove(curproc->openFileTable, fd);
+  KASSERT(sf != NULL);
 
-  struct vnode * vn = sf->vn;
+  //se era l'ultimo riferimento chiude il vnode e ricicla la entry
+  systable_decref(sf);
 
-  if(vn == NULL) return EBADF;
+  return 0;
+}
 
-  lock_acquire(sf->lock);
+//pipe(): fds[0] è il lato in lettura, fds[1] quello in scrittura.
+//Le due entry finiscono nella systemFileTable come file normali, quindi
+//dup2, fork e close funzionano senza casi particolari.
+int sys_pipe(userptr_t fds, int *retval){
+  struct vnode *rvn, *wvn;
+  struct systemFileTable *rsf, *wsf;
+  int kfds[2];
+  int result;
 
-  sf->count_refs--;
+  result = pipe_create(&rvn, &wvn);
+  if(result) return result;
 
-  if(sf->count_refs == 0){
-    vfs_close(vn);
-    sf->vn=NULL;
+  rsf = systable_alloc(rvn, O_RDONLY);
+  if(rsf == NULL){
+    vfs_close(rvn);
+    vfs_close(wvn);
+    return ENFILE;
+  }
+  wsf = systable_alloc(wvn, O_WRONLY);
+  if(wsf == NULL){
+    systable_decref(rsf);
+    vfs_close(wvn);
+    return ENFILE;
   }
 
-  curproc->openFileTable[fd] = NULL;
+  result = fdtable_unshare(&curproc->openFileTable);
+  if(result) goto fail;
 
-  lock_release(sf->lock);
+  result = fdtable_alloc(curproc->openFileTable, rsf, &kfds[0]);
+  if(result) goto fail;
+  result = fdtable_alloc(curproc->openFileTable, wsf, &kfds[1]);
+  if(result){
+    fdtable_remove(curproc->openFileTable, kfds[0]);
+    goto fail;
+  }
 
+  result = copyout(kfds, fds, sizeof(kfds));
+  if(result){
+    fdtable_remove(curproc->openFileTable, kfds[1]);
+    fdtable_remove(curproc->openFileTable, kfds[0]);
+    goto fail;
+  }
+
+  *retval = 0;
   return 0;
+
+fail:
+  //systable_decref chiude i vnode, e l'ultimo dei due libera la pipe
+  systable_decref(wsf);
+  systable_decref(rsf);
+  return result;
 }
 #endif
 
@@ -277,14 +403,14 @@ int sys_lseek(int fd, off_t pos, int whence, int32_t * ret_low, int32_t * ret_up
   off_t retval = -1;
 
   //constrolliamo che non facciamo lseek sul stdinput, output e error
-  if(fd <= STDERR_FILENO || fd > OPEN_MAX) return EBADF;
+  if(fd <= STDERR_FILENO) return EBADF;
 
   //con SEEK_SET e SEEK_END non si possono dare valori negativi
   if(pos < 0 && whence != SEEK_CUR){
     return EINVAL; 
   }
 
-  struct systemFileTable * sf = curproc->openFileTable[fd];
+  struct systemFileTable * sf = fdtable_get(curproc->openFileTable, fd);
   if(sf == NULL) return EBADF;
 
   struct vnode * vn = sf->vn;
@@ -339,29 +465,35 @@ int sys_lseek(int fd, off_t pos, int whence, int32_t * ret_low, int32_t * ret_up
 
 //esegue un clone del file descriptor
 int sys_dup2(int oldfd, int newfd){
-  if(oldfd < 0 || oldfd >= OPEN_MAX) return EBADF;
-  
-  if(newfd < 0 || newfd >= OPEN_MAX) return EBADF;
+  int err;
+
+  if(newfd < 0 || newfd >= FD_MAX) return EBADF;
+
+  struct systemFileTable * sf = fdtable_get(curproc->openFileTable, oldfd);
+  if(sf == NULL) return EBADF;
 
   if(oldfd == newfd){
     return oldfd;
   }
 
-  struct systemFileTable * sf = curproc->openFileTable[oldfd];
-  if(sf == NULL) return EBADF;
-
   struct vnode * vn = sf->vn;
   if(vn == NULL) return EBADF;
+
+  //la File Table potrebbe essere condivisa dopo una fork
+  err = fdtable_unshare(&curproc->openFileTable);
+  if(err) return err;
   
   //chiusura file di newdf se aperto
-  if(curproc->openFileTable[newfd]->vn != NULL){
+  if(fdtable_get(curproc->openFileTable, newfd) != NULL){
     sys_close(newfd);
   }
 
-  lock_acquire(curproc->openFileTable[oldfd]->lock);
-  curproc->openFileTable[newfd] = curproc->openFileTable[oldfd];
-  curproc->openFileTable[oldfd]->count_refs++;
-  lock_release(curproc->openFileTable[oldfd]->lock);
+  systable_incref(sf);
+  err = fdtable_place(curproc->openFileTable, newfd, sf);
+  if(err){
+    systable_decref(sf);
+    return err;
+  }
 
   return newfd;
 }
@@ -375,14 +507,15 @@ int sys_chdir(const char *pathname){
 
   int err = -1;
 
-  char *kbuf = (char *) kmalloc(PATH_MAX * sizeof(char));
+  //liberato da scratch_reset() all'uscita dalla syscall
+  char *kbuf = (char *) scratch_alloc(PATH_MAX * sizeof(char));
     if (kbuf == NULL) {
         return ENOMEM;
     }
 
   //p_cwd è un vnode, dobbiamo aprire la cartella
   struct vnode * vn = NULL;
-  err = copyinstr((userptr_t)pathname, kbuf, sizeof( kbuf ), NULL );
+  err = copyinstr((userptr_t)pathname, kbuf, PATH_MAX, NULL );
 
   if(err){
     return EFAULT;
@@ -437,4 +570,46 @@ int sys__getcwd(char *buf, size_t buflen, int * retval){
   *retval = buflen - u.uio_resid;
   return 0; 
 }
+
+//legge più entry della directory in una volta sola, come record struct dirent
+//(kern/dirent.h) impacchettati nel buffer utente; ritorna i byte scritti,
+//0 a fine directory. sf->offset fa da cookie e viene copiato in *cookiep
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, userptr_t cookiep,
+                      int * retval){
+  struct systemFileTable *sf;
+  struct iovec iov;
+  struct uio u;
+  off_t cookie;
+  int err;
+
+  if(buf == NULL){
+    return EFAULT;
+  }
+  //il valore di ritorno è un int
+  if(buflen > 0x7fffffff){
+    buflen = 0x7fffffff;
+  }
+
+  err = file_get(fd, UIO_READ, &sf);
+  if(err) return err;
+
+  lock_acquire(sf->lock);
+  uio_uinit(&iov, &u, buf, buflen, sf->offset, UIO_READ);
+  err = VOP_GETDIRENTRIES(sf->vn, &u);
+  if(err){
+    lock_release(sf->lock);
+    return err;
+  }
+  sf->offset = u.uio_offset;
+  cookie = sf->offset;
+  lock_release(sf->lock);
+
+  if(cookiep != NULL){
+    err = copyout(&cookie, cookiep, sizeof(cookie));
+    if(err) return err;
+  }
+
+  *retval = buflen - u.uio_resid;
+  return 0;
+}
 #endif
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include <synch.h>
 #include <kern/errno.h>
 #include <proc.h>
+#include <scratch.h>
 
 void sys__exit(int status)
 {
@@ -94,7 +95,8 @@ int sys_fork(struct trapframe *ctf, pid_t *retval)
 
   KASSERT(curproc != NULL);
 
-  newp = proc_create_runprogram(curproc->p_name);
+  //il figlio condivide la tabella dei fd del padre (copy-on-write)
+  newp = proc_create_fork(curproc->p_name);
   if (newp == NULL)
   {
     return ENOMEM;
@@ -117,9 +119,6 @@ int sys_fork(struct trapframe *ctf, pid_t *retval)
   }
   memcpy(tf_child, ctf, sizeof(struct trapframe));
 
-  //copiamo la open file table del processo padre nel figlio
-  copyOpenFileTable(curproc, newp);
-
   add_child(curproc, newp);
   newp->parent_pid = curproc->p_pid;
 
@@ -156,12 +155,13 @@ int sys_execv(const char *program, char * args[]){
 	struct arg_buf kargv;
 
   //spostamento program da user a kernel
-  char *kpath = (char *) kmalloc(PATH_MAX * sizeof(char));
+  //kpath sta nella scratch area del thread, non va liberato
+  char *kpath = (char *) scratch_alloc(PATH_MAX * sizeof(char));
   if (kpath == NULL) {
 		return ENOMEM;
 	}
   err = copyinstr(uprogram, kpath, PATH_MAX, NULL);
-  if(err) {kfree(kpath); return ENOMEM;}
+  if(err) {return ENOMEM;}
 
   //spostamento args da memoria user a a memoria kernel
 
@@ -178,7 +178,6 @@ int sys_execv(const char *program, char * args[]){
 	err = argbuf_fromuser(&kargv, uargv, num_args, len_args);
   if(err) { 
     kfree(kargv.data);
-    kfree(kpath);
     return ENOMEM;
   }
 
@@ -192,8 +191,9 @@ int sys_execv(const char *program, char * args[]){
 		panic("execv: copyout_args failed: %s\n", strerror(err));
 	}
   //non servono più
+  //(enter_new_process non ritorna in syscall(), svuotiamo qui la scratch area)
   kfree(kargv.data);
-  kfree(kpath);
+  scratch_reset();
 
   enter_new_process(kargv.nargs, uargv, NULL /*uenv*/, stackptr, entrypoint);
 
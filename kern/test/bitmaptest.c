@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,25 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Lowest-first, near-hint, and run allocation. */
+	bitmap_unmark(b, 7);
+	bitmap_unmark(b, 300);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==300);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==7);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==ENOSPC);
+	for (i=200; i<240; i++) {
+		bitmap_unmark(b, i);
+	}
+	bitmap_unmark(b, 5);
+	KASSERT(bitmap_find_run(b, 0, 40, &x)==0 && x==200);
+	KASSERT(bitmap_find_run(b, 0, 41, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_range(b, 0, 32, &x)==0 && x==200);
+	KASSERT(bitmap_alloc(b, &x)==0 && x==5);
+	KASSERT(bitmap_alloc(b, &x)==0 && x==232);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i) || (i>232 && i<240));
+	}
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,97 @@
+/*
+ * Per-thread scratch arena. See scratch.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <thread.h>
+#include <current.h>
+#include <scratch.h>
+
+/*
+ * Header for an allocation too big for the arena. The client's
+ * memory follows it, so it is padded to keep that 8-aligned.
+ */
+struct scratch_big {
+	struct scratch_big *sb_next;
+	uint32_t sb_pad;
+};
+
+#define SCRATCH_ALIGN 8
+
+void
+scratch_init(struct scratch *sc)
+{
+	sc->sc_base = NULL;
+	sc->sc_used = 0;
+	sc->sc_big = NULL;
+}
+
+static
+void
+scratch_release(struct scratch *sc)
+{
+	struct scratch_big *sb;
+
+	while (sc->sc_big != NULL) {
+		sb = sc->sc_big;
+		sc->sc_big = sb->sb_next;
+		kfree(sb);
+	}
+	sc->sc_used = 0;
+}
+
+void
+scratch_cleanup(struct scratch *sc)
+{
+	scratch_release(sc);
+	if (sc->sc_base != NULL) {
+		kfree(sc->sc_base);
+		sc->sc_base = NULL;
+	}
+}
+
+void *
+scratch_alloc(size_t sz)
+{
+	struct scratch *sc;
+	struct scratch_big *sb;
+	void *ret;
+
+	KASSERT(curthread != NULL);
+	KASSERT(!curthread->t_in_interrupt);
+	sc = &curthread->t_scratch;
+
+	if (sz > (size_t)-1 - sizeof(struct scratch_big) - SCRATCH_ALIGN) {
+		return NULL;
+	}
+	sz = ROUNDUP(sz, SCRATCH_ALIGN);
+
+	if (sz <= SCRATCH_SIZE - sc->sc_used) {
+		if (sc->sc_base == NULL) {
+			sc->sc_base = kmalloc(SCRATCH_SIZE);
+		}
+		if (sc->sc_base != NULL) {
+			ret = sc->sc_base + sc->sc_used;
+			sc->sc_used += sz;
+			return ret;
+		}
+	}
+
+	COMPILE_ASSERT(sizeof(struct scratch_big) % SCRATCH_ALIGN == 0);
+	sb = kmalloc(sizeof(*sb) + sz);
+	if (sb == NULL) {
+		return NULL;
+	}
+	sb->sb_next = sc->sc_big;
+	sc->sc_big = sb;
+	return sb + 1;
+}
+
+void
+scratch_reset(void)
+{
+	KASSERT(curthread != NULL);
+	scratch_release(&curthread->t_scratch);
+}
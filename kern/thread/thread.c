@@ -147,6 +147,9 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	scratch_init(&thread->t_scratch);
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -279,6 +282,7 @@ thread_destroy(struct thread *thread)
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
+	scratch_cleanup(&thread->t_scratch);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
@@ -0,0 +1,99 @@
+/*
+ * Asynchronous block I/O: waiting for requests.
+ *
+ * The drivers do the real work (see devop_strategy). Callers that
+ * want to wait for a request use bio_wakeup as its completion
+ * callback; since that runs in interrupt context, it can't take a
+ * lock or post to a per-request semaphore without allocating one for
+ * every request, so all waiters share one wait channel and check
+ * their own bio_finished when woken up.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <device.h>
+
+static struct spinlock bio_spinlock;
+static struct wchan *bio_wchan;
+
+void
+bio_bootstrap(void)
+{
+	spinlock_init(&bio_spinlock);
+	bio_wchan = wchan_create("bio");
+	if (bio_wchan == NULL) {
+		panic("bio_bootstrap: Out of memory\n");
+	}
+}
+
+void
+bio_init(struct bio *bio, daddr_t block, unsigned nblocks,
+	 void *data, bool write)
+{
+	bio->bio_block = block;
+	bio->bio_nblocks = nblocks;
+	bio->bio_data = data;
+	bio->bio_write = write;
+	bio->bio_done = bio_wakeup;
+	bio->bio_arg = NULL;
+	bio->bio_error = 0;
+	bio->bio_finished = false;
+	bio->bio_next = NULL;
+	bio->bio_chain = NULL;
+	bio->bio_chaintail = NULL;
+}
+
+/*
+ * Completion callback: mark BIO finished and wake up bio_wait.
+ */
+void
+bio_wakeup(struct bio *bio)
+{
+	spinlock_acquire(&bio_spinlock);
+	bio->bio_finished = true;
+	wchan_wakeall(bio_wchan, &bio_spinlock);
+	spinlock_release(&bio_spinlock);
+}
+
+/*
+ * Wait until BIO, which must have bio_wakeup as its callback and have
+ * been accepted by devop_strategy, is done. Returns with bio_error
+ * set.
+ */
+void
+bio_wait(struct bio *bio)
+{
+	KASSERT(bio->bio_done == bio_wakeup);
+
+	spinlock_acquire(&bio_spinlock);
+	while (!bio->bio_finished) {
+		wchan_sleep(bio_wchan, &bio_spinlock);
+	}
+	spinlock_release(&bio_spinlock);
+}
+
+/*
+ * Synchronous block I/O through devop_strategy.
+ */
+int
+bio_io(struct device *d, daddr_t block, unsigned nblocks,
+       void *data, bool write)
+{
+	struct bio bio;
+	int result;
+
+	if (!DEVOP_HASSTRATEGY(d)) {
+		return ENOSYS;
+	}
+
+	bio_init(&bio, block, nblocks, data, write);
+	result = DEVOP_STRATEGY(d, &bio);
+	if (result) {
+		return result;
+	}
+	bio_wait(&bio);
+	return bio.bio_error;
+}
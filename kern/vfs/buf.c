@@ -0,0 +1,975 @@
+/*
+ * Block buffer cache. See buf.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <device.h>
+#include <buf.h>
+
+/* Number of hash chains. */
+#define BUFFER_HASHSIZE 64
+
+/* Protects the hash table, the lists and buffer state. */
+static struct lock *buffer_lock;
+
+/* Threads waiting for a busy buffer sleep here. */
+static struct cv *buffer_cv;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+static struct buf *buffer_dirtyhead;	/* dirty longest */
+static struct buf *buffer_dirtytail;	/* dirty most recently */
+static unsigned buffer_num;		/* buffers allocated */
+static unsigned buffer_ndirty;		/* buffers on the dirty list */
+
+/* Readahead requests (ring buffer), and the one being worked on. */
+static struct {
+	struct device *ra_dev;
+	daddr_t ra_block;
+} buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_racount;
+static struct device *buffer_racurrent;
+
+/* The readahead thread sleeps here. */
+static struct cv *buffer_racv;
+
+/* Counters for buffer_printstats. */
+static struct {
+	unsigned long hits;		/* buffer_read found it */
+	unsigned long misses;		/* buffer_read had to read it */
+	unsigned long raissued;		/* read by the readahead thread */
+	unsigned long rahits;		/* ...and then asked for */
+	unsigned long rawasted;		/* ...and never asked for */
+	unsigned long radropped;	/* queue was full */
+} buffer_stats;
+
+static void buffer_flusher(void *, unsigned long);
+static void buffer_reader(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_racv = cv_create("buffer readahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_num = 0;
+	buffer_ndirty = 0;
+	buffer_rahead = buffer_racount = 0;
+	buffer_racurrent = NULL;
+
+	result = thread_fork("bufflush", NULL, buffer_flusher, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("bufra", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and lists (cache lock held)
+
+static
+unsigned
+buffer_hashfn(struct device *dev, daddr_t block)
+{
+	return (dev->d_devnumber * 31 + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfn(dev, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_add(struct buf *b)
+{
+	unsigned h = buffer_hashfn(b->b_dev, b->b_block);
+
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	bp = &buffer_hash[buffer_hashfn(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lru_append(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+static
+void
+buffer_dirty_remove(struct buf *b)
+{
+	KASSERT(b->b_dirty);
+
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		buffer_dirtyhead = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	else {
+		buffer_dirtytail = b->b_dirtyprev;
+	}
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+	b->b_dirty = false;
+	buffer_ndirty--;
+}
+
+static
+void
+buffer_dirty_append(struct buf *b)
+{
+	struct timespec now;
+
+	KASSERT(!b->b_dirty);
+
+	gettime(&now);
+	b->b_dirtytime = now.tv_sec;
+	b->b_dirty = true;
+
+	b->b_dirtynext = NULL;
+	b->b_dirtyprev = buffer_dirtytail;
+	if (buffer_dirtytail != NULL) {
+		buffer_dirtytail->b_dirtynext = b;
+	}
+	else {
+		buffer_dirtyhead = b;
+	}
+	buffer_dirtytail = b;
+	buffer_ndirty++;
+}
+
+/*
+ * B is being thrown out or recycled.
+ */
+static
+void
+buffer_forget(struct buf *b)
+{
+	KASSERT(!b->b_dirty);
+
+	if (b->b_readahead) {
+		buffer_stats.rawasted++;
+		b->b_readahead = false;
+	}
+}
+
+static
+void
+buffer_destroy(struct buf *b)
+{
+	buffer_forget(b);
+
+	kfree(b->b_data);
+	kfree(b);
+	buffer_num--;
+}
+
+/*
+ * Take a reference to B, pulling it off the LRU list if need be.
+ */
+static
+void
+buffer_ref(struct buf *b)
+{
+	if (b->b_refcount == 0) {
+		buffer_lru_remove(b);
+	}
+	b->b_refcount++;
+}
+
+/*
+ * Become B's owner. Must hold a reference.
+ */
+static
+void
+buffer_own(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	while (b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	b->b_busy = true;
+}
+
+/*
+ * Give up ownership of B and the reference that went with it.
+ */
+static
+void
+buffer_unown(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_refcount > 0);
+	b->b_busy = false;
+	b->b_refcount--;
+
+	if (b->b_refcount == 0) {
+		if (b->b_valid) {
+			buffer_lru_append(b);
+		}
+		else {
+			/* Nothing worth keeping */
+			buffer_hash_remove(b);
+			buffer_destroy(b);
+		}
+	}
+	/* Wake up anyone waiting for it (or for it to go idle) */
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Disk I/O (buffer owned, cache lock not held)
+
+/*
+ * Transfer a buffer once, through the device's request queue if it
+ * has one.
+ */
+static
+int
+buffer_devio(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	if (DEVOP_HASSTRATEGY(b->b_dev)) {
+		return bio_io(b->b_dev, b->b_block, 1, b->b_data,
+			      rw == UIO_WRITE);
+	}
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  ((off_t)b->b_block) * BUFFER_SIZE, rw);
+	return DEVOP_IO(b->b_dev, &ku);
+}
+
+/*
+ * Read or write a buffer, retrying I/O errors.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+
+	DEBUG(DB_VFS, "buffer: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+ retry:
+	result = buffer_devio(b, rw);
+	if (result == EINVAL) {
+		/*
+		 * The block was out of range or something else
+		 * that's the filesystem's fault.
+		 */
+		panic("buffer: block %u: DEVOP_IO returned EINVAL\n",
+		      b->b_block);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up "
+				"after %d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write out a dirty buffer. If that fails for good the data is lost;
+ * keeping it dirty would only clog the cache.
+ */
+static
+int
+buffer_clean(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	result = buffer_io(b, UIO_WRITE);
+
+	lock_acquire(buffer_lock);
+	buffer_dirty_remove(b);
+	if (result) {
+		kprintf("buffer: block %u: write lost\n", b->b_block);
+		b->b_valid = false;
+	}
+	lock_release(buffer_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Write-back
+
+/*
+ * Take references to up to MAX dirty buffers of DEV (any device if
+ * NULL) that got dirty no later than CUTOFF, oldest first.
+ */
+static
+unsigned
+buffer_collect(struct device *dev, time_t cutoff,
+	       struct buf **batch, unsigned max)
+{
+	struct buf *b;
+	unsigned n = 0;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_dirtyhead; b != NULL && n < max; b = b->b_dirtynext) {
+		if (b->b_dirtytime > cutoff) {
+			break;
+		}
+		if (dev != NULL && b->b_dev != dev) {
+			continue;
+		}
+		buffer_ref(b);
+		batch[n++] = b;
+	}
+	return n;
+}
+
+/*
+ * Finish writing a buffer queued by buffer_writebatch: wait for it,
+ * and if that failed, fall back to buffer_clean to retry. Then give
+ * up the buffer.
+ */
+static
+int
+buffer_writedone(struct buf *b)
+{
+	int result;
+
+	bio_wait(&b->b_bio);
+	if (b->b_bio.bio_error) {
+		/* This takes it off the dirty list either way */
+		result = buffer_clean(b);
+		lock_acquire(buffer_lock);
+	}
+	else {
+		result = 0;
+		lock_acquire(buffer_lock);
+		buffer_dirty_remove(b);
+	}
+	buffer_unown(b);
+	lock_release(buffer_lock);
+
+	return result;
+}
+
+/*
+ * Write out a batch from buffer_collect, in disk order, and drop the
+ * references. Buffers cleaned by someone else in the meantime are
+ * skipped. Returns the first error.
+ *
+ * Buffers of devices with a request queue are all queued before
+ * waiting for any of them, so the driver can order and merge the
+ * writes. We keep owning the ones in flight, so before waiting to own
+ * another buffer (whose owner might be waiting for one of ours) we
+ * finish everything queued so far.
+ */
+static
+int
+buffer_writebatch(struct buf **batch, unsigned n)
+{
+	struct buf *b;
+	unsigned i, j, first;
+	int result, err = 0;
+
+	/* Insertion sort by (device, block); the batch is small. */
+	for (i = 1; i < n; i++) {
+		b = batch[i];
+		for (j = i; j > 0; j--) {
+			if (batch[j-1]->b_dev->d_devnumber <
+			    b->b_dev->d_devnumber) {
+				break;
+			}
+			if (batch[j-1]->b_dev == b->b_dev &&
+			    batch[j-1]->b_block < b->b_block) {
+				break;
+			}
+			batch[j] = batch[j-1];
+		}
+		batch[j] = b;
+	}
+
+	/* batch[first..i) are queued */
+	first = 0;
+	for (i = 0; i < n; i++) {
+		b = batch[i];
+
+		lock_acquire(buffer_lock);
+		if (b->b_busy && first < i) {
+			lock_release(buffer_lock);
+			for (; first < i; first++) {
+				if (batch[first] == NULL) {
+					continue;
+				}
+				result = buffer_writedone(batch[first]);
+				if (result && err == 0) {
+					err = result;
+				}
+			}
+			lock_acquire(buffer_lock);
+		}
+		buffer_own(b);
+		lock_release(buffer_lock);
+
+		if (b->b_dirty && DEVOP_HASSTRATEGY(b->b_dev)) {
+			DEBUG(DB_VFS, "buffer: queue write %u\n", b->b_block);
+			bio_init(&b->b_bio, b->b_block, 1, b->b_data, true);
+			result = DEVOP_STRATEGY(b->b_dev, &b->b_bio);
+			if (result == 0) {
+				continue;
+			}
+			/* Let buffer_clean sort it out */
+		}
+
+		if (b->b_dirty) {
+			result = buffer_clean(b);
+			if (result && err == 0) {
+				err = result;
+			}
+		}
+
+		lock_acquire(buffer_lock);
+		buffer_unown(b);
+		lock_release(buffer_lock);
+		batch[i] = NULL;
+	}
+
+	for (; first < n; first++) {
+		if (batch[first] == NULL) {
+			continue;
+		}
+		result = buffer_writedone(batch[first]);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/*
+ * One round of the flusher: write out buffers that have been dirty
+ * too long, and if too many are dirty, the oldest ones regardless.
+ */
+static
+void
+buffer_flush_old(void)
+{
+	struct buf *batch[BUFFER_BATCH];
+	struct timespec now;
+	unsigned n, max;
+	bool overfull;
+
+	lock_acquire(buffer_lock);
+	overfull = buffer_ndirty > BUFFER_DIRTY_HIGH;
+	do {
+		gettime(&now);
+		if (overfull && buffer_ndirty > BUFFER_DIRTY_LOW) {
+			max = buffer_ndirty - BUFFER_DIRTY_LOW;
+			if (max > BUFFER_BATCH) {
+				max = BUFFER_BATCH;
+			}
+			n = buffer_collect(NULL, now.tv_sec, batch, max);
+		}
+		else {
+			overfull = false;
+			n = buffer_collect(NULL,
+					   now.tv_sec - BUFFER_FLUSH_AGE,
+					   batch, BUFFER_BATCH);
+		}
+		lock_release(buffer_lock);
+
+		/* errors have already been reported */
+		buffer_writebatch(batch, n);
+
+		lock_acquire(buffer_lock);
+	} while (n > 0);
+	lock_release(buffer_lock);
+}
+
+static
+void
+buffer_flusher(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+		buffer_flush_old();
+	}
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *batch[BUFFER_BATCH];
+	struct timespec now;
+	unsigned n;
+	int result, err = 0;
+
+	do {
+		lock_acquire(buffer_lock);
+		gettime(&now);
+		n = buffer_collect(dev, now.tv_sec, batch, BUFFER_BATCH);
+		lock_release(buffer_lock);
+
+		result = buffer_writebatch(batch, n);
+		if (result && err == 0) {
+			err = result;
+		}
+	} while (n > 0);
+
+	return err;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Come up with a buffer to hold a block that isn't cached: a new one
+ * while we're under BUFFER_MAX, otherwise the least recently used
+ * clean one. If they're all dirty, write out the oldest and return
+ * EAGAIN; the lock was dropped meanwhile, so the caller has to look
+ * the block up again.
+ */
+static
+int
+buffer_alloc(struct buf **ret)
+{
+	struct buf *b;
+
+	if (buffer_num < BUFFER_MAX || buffer_lruhead == NULL) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUFFER_SIZE);
+			if (b->b_data != NULL) {
+				b->b_hashnext = NULL;
+				b->b_lruprev = b->b_lrunext = NULL;
+				b->b_dirtyprev = b->b_dirtynext = NULL;
+				b->b_dirty = false;
+				b->b_readahead = false;
+				buffer_num++;
+				*ret = b;
+				return 0;
+			}
+			kfree(b);
+		}
+		/* Out of memory; fall back to recycling, if we can. */
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_dirty) {
+			buffer_lru_remove(b);
+			buffer_hash_remove(b);
+			buffer_forget(b);
+			*ret = b;
+			return 0;
+		}
+	}
+
+	b = buffer_lruhead;
+	if (b == NULL) {
+		return ENOMEM;
+	}
+
+	buffer_ref(b);
+	buffer_own(b);
+	lock_release(buffer_lock);
+	/* errors have already been reported */
+	buffer_clean(b);
+	lock_acquire(buffer_lock);
+	buffer_unown(b);
+	return EAGAIN;
+}
+
+/*
+ * Common code for buffer_get and buffer_read; FORREAD says which, for
+ * the counters.
+ */
+static
+int
+buffer_lookup(struct device *dev, daddr_t block, bool forread,
+	      struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buffer_lock);
+
+ again:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		buffer_ref(b);
+		buffer_own(b);
+		if (forread && b->b_valid) {
+			buffer_stats.hits++;
+			if (b->b_readahead) {
+				buffer_stats.rahits++;
+			}
+		}
+		else if (forread) {
+			buffer_stats.misses++;
+		}
+		else if (b->b_readahead) {
+			/* about to be overwritten without a look */
+			buffer_stats.rawasted++;
+		}
+		b->b_readahead = false;
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	result = buffer_alloc(&b);
+	if (result == EAGAIN) {
+		goto again;
+	}
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+	if (forread) {
+		buffer_stats.misses++;
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_refcount = 1;
+	b->b_busy = true;
+	b->b_valid = false;
+	buffer_hash_add(b);
+
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_lookup(dev, block, false, ret);
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_lookup(dev, block, true, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = buffer_io(b, UIO_READ);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+
+	lock_acquire(buffer_lock);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		buffer_dirty_append(b);
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_invalidate(struct buf *b)
+{
+	KASSERT(b->b_busy);
+
+	lock_acquire(buffer_lock);
+	if (b->b_dirty) {
+		buffer_dirty_remove(b);
+	}
+	b->b_valid = false;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_unown(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	b = buffer_find(dev, block);
+	/*
+	 * If someone (the flusher) has it, leave it be; the worst
+	 * that can happen is a useless write.
+	 */
+	if (b != NULL && b->b_refcount == 0) {
+		if (b->b_dirty) {
+			buffer_dirty_remove(b);
+		}
+		buffer_lru_remove(b);
+		buffer_hash_remove(b);
+		buffer_destroy(b);
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_purge(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, j, n;
+
+	lock_acquire(buffer_lock);
+
+	/* Cancel pending readahead and wait for any in progress */
+	n = buffer_racount;
+	buffer_racount = 0;
+	for (i = 0; i < n; i++) {
+		j = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raqueue[j].ra_dev != dev) {
+			buffer_raqueue[(buffer_rahead + buffer_racount)
+				       % BUFFER_RAQUEUE] = buffer_raqueue[j];
+			buffer_racount++;
+		}
+	}
+	while (buffer_racurrent == dev) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+ again:
+	for (i = 0; i < BUFFER_HASHSIZE; i++) {
+		for (b = buffer_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_dev != dev) {
+				continue;
+			}
+			if (b->b_refcount > 0) {
+				/* The flusher, probably; wait for it. */
+				cv_wait(buffer_cv, buffer_lock);
+				goto again;
+			}
+			KASSERT(!b->b_dirty);
+			buffer_lru_remove(b);
+			buffer_hash_remove(b);
+			buffer_destroy(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Readahead
+
+void
+buffer_readahead(struct device *dev, daddr_t block)
+{
+	unsigned i;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buffer_lock);
+	if (buffer_find(dev, block) != NULL) {
+		/* already there (or on its way) */
+		lock_release(buffer_lock);
+		return;
+	}
+	if (buffer_racount == BUFFER_RAQUEUE) {
+		buffer_stats.radropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	i = (buffer_rahead + buffer_racount) % BUFFER_RAQUEUE;
+	buffer_raqueue[i].ra_dev = dev;
+	buffer_raqueue[i].ra_block = block;
+	buffer_racount++;
+	cv_signal(buffer_racv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * The readahead thread: read queued blocks into the cache.
+ */
+static
+void
+buffer_reader(void *data1, unsigned long data2)
+{
+	struct device *dev;
+	daddr_t block;
+	struct buf *b;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(buffer_lock);
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		dev = buffer_raqueue[buffer_rahead].ra_dev;
+		block = buffer_raqueue[buffer_rahead].ra_block;
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_racount--;
+		buffer_racurrent = dev;
+		lock_release(buffer_lock);
+
+		result = buffer_get(dev, block, &b);
+		if (result == 0) {
+			if (!b->b_valid) {
+				result = buffer_io(b, UIO_READ);
+				lock_acquire(buffer_lock);
+				if (result == 0) {
+					b->b_valid = true;
+					b->b_readahead = true;
+					buffer_stats.raissued++;
+				}
+				lock_release(buffer_lock);
+			}
+			buffer_release(b);
+		}
+
+		lock_acquire(buffer_lock);
+		buffer_racurrent = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+		lock_release(buffer_lock);
+	}
+}
+
+void
+buffer_printstats(void)
+{
+	lock_acquire(buffer_lock);
+	kprintf("Buffer cache: %u buffers, %u dirty\n",
+		buffer_num, buffer_ndirty);
+	kprintf("    %lu hits, %lu misses\n",
+		buffer_stats.hits, buffer_stats.misses);
+	kprintf("    readahead: %lu read, %lu used, %lu wasted, "
+		"%lu dropped\n", buffer_stats.raissued, buffer_stats.rahits,
+		buffer_stats.rawasted, buffer_stats.radropped);
+	lock_release(buffer_lock);
+}
@@ -0,0 +1,318 @@
+/*
+ * Anonymous pipes: a ring buffer in kernel memory with a vnode for
+ * each end.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <pipe.h>
+
+struct pipe {
+	struct vnode pp_readvn;		/* read end */
+	struct vnode pp_writevn;	/* write end */
+
+	struct lock *pp_lock;		/* protects everything below */
+	struct cv *pp_readcv;		/* readers wait here for data */
+	struct cv *pp_writecv;		/* writers wait here for space */
+	char *pp_buf;			/* PIPE_SIZE bytes */
+	unsigned pp_head;		/* next byte to read */
+	unsigned pp_count;		/* bytes in the buffer */
+	bool pp_readopen;		/* read end not yet released */
+	bool pp_writeopen;		/* write end not yet released */
+};
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	KASSERT(!pp->pp_readopen && !pp->pp_writeopen);
+
+	kfree(pp->pp_buf);
+	cv_destroy(pp->pp_writecv);
+	cv_destroy(pp->pp_readcv);
+	lock_destroy(pp->pp_lock);
+	kfree(pp);
+}
+
+/*
+ * Called when the last reference to one end goes away.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+	bool gone;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_readvn) {
+		KASSERT(pp->pp_readopen);
+		pp->pp_readopen = false;
+	}
+	else {
+		KASSERT(v == &pp->pp_writevn);
+		KASSERT(pp->pp_writeopen);
+		pp->pp_writeopen = false;
+	}
+	vnode_cleanup(v);
+
+	/* Wake up anyone on the other end: EOF or EPIPE. */
+	cv_broadcast(pp->pp_readcv, pp->pp_lock);
+	cv_broadcast(pp->pp_writecv, pp->pp_lock);
+
+	gone = !pp->pp_readopen && !pp->pp_writeopen;
+	lock_release(pp->pp_lock);
+
+	if (gone) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+/*
+ * Read. Blocks until there is some data or no more writers, then
+ * returns what is there (up to the size of the request).
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	size_t len;
+	int result = 0;
+
+	if (v != &pp->pp_readvn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (pp->pp_count == 0 && pp->pp_writeopen) {
+		cv_wait(pp->pp_readcv, pp->pp_lock);
+	}
+
+	/* Two rounds at most: up to the end of the buffer, then from 0. */
+	while (pp->pp_count > 0 && uio->uio_resid > 0) {
+		len = pp->pp_count;
+		if (len > PIPE_SIZE - pp->pp_head) {
+			len = PIPE_SIZE - pp->pp_head;
+		}
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + pp->pp_head, len, uio);
+		if (result) {
+			break;
+		}
+		pp->pp_head = (pp->pp_head + len) % PIPE_SIZE;
+		pp->pp_count -= len;
+	}
+
+	cv_broadcast(pp->pp_writecv, pp->pp_lock);
+	lock_release(pp->pp_lock);
+	return result;
+}
+
+/*
+ * Write. Blocks while the buffer is full, until everything has been
+ * written or the read end goes away.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	size_t len, tail;
+	int result = 0;
+
+	if (v != &pp->pp_writevn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (uio->uio_resid > 0) {
+		while (pp->pp_count == PIPE_SIZE && pp->pp_readopen) {
+			cv_wait(pp->pp_writecv, pp->pp_lock);
+		}
+		if (!pp->pp_readopen) {
+			result = EPIPE;
+			break;
+		}
+
+		tail = (pp->pp_head + pp->pp_count) % PIPE_SIZE;
+		len = PIPE_SIZE - pp->pp_count;
+		if (len > PIPE_SIZE - tail) {
+			len = PIPE_SIZE - tail;
+		}
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + tail, len, uio);
+		if (result) {
+			break;
+		}
+		pp->pp_count += len;
+		cv_broadcast(pp->pp_readcv, pp->pp_lock);
+	}
+	lock_release(pp->pp_lock);
+	return result;
+}
+
+static
+int
+pipe_eachopen(struct vnode *v, int flags)
+{
+	/* Pipes can't be opened by name. */
+	(void)v;
+	(void)flags;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	lock_acquire(pp->pp_lock);
+	statbuf->st_size = pp->pp_count;
+	lock_release(pp->pp_lock);
+	statbuf->st_mode = S_IFIFO;
+	statbuf->st_nlink = 1;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_namefile(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = pipe_namefile,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+int
+pipe_create(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	if (pp->pp_buf == NULL) {
+		goto fail_pp;
+	}
+	pp->pp_lock = lock_create("pipe");
+	if (pp->pp_lock == NULL) {
+		goto fail_buf;
+	}
+	pp->pp_readcv = cv_create("pipe-read");
+	if (pp->pp_readcv == NULL) {
+		goto fail_lock;
+	}
+	pp->pp_writecv = cv_create("pipe-write");
+	if (pp->pp_writecv == NULL) {
+		goto fail_readcv;
+	}
+	pp->pp_head = 0;
+	pp->pp_count = 0;
+	pp->pp_readopen = true;
+	pp->pp_writeopen = true;
+
+	vnode_init(&pp->pp_readvn, &pipe_vnode_ops, NULL, pp);
+	vnode_init(&pp->pp_writevn, &pipe_vnode_ops, NULL, pp);
+
+	*readvn = &pp->pp_readvn;
+	*writevn = &pp->pp_writevn;
+	return 0;
+
+ fail_readcv:
+	cv_destroy(pp->pp_readcv);
+ fail_lock:
+	lock_destroy(pp->pp_lock);
+ fail_buf:
+	kfree(pp->pp_buf);
+ fail_pp:
+	kfree(pp);
+	return ENOMEM;
+}
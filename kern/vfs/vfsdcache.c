@@ -0,0 +1,329 @@
+/*
+ * Name lookup cache for vfs_lookup.
+ *
+ * Maps (starting directory vnode, path relative to it) to the vnode
+ * VOP_LOOKUP handed back, or to "no such file" (a negative entry).
+ * Filesystems look up whole relative paths, not single components,
+ * so the path left over after the device prefix is the key.
+ *
+ * Each entry holds a reference to both vnodes. Removing or renaming a
+ * name drops all of the filesystem's entries; creating one can only
+ * make "no such file" wrong, so it drops just the negative entries.
+ * Either way the filesystem's generation number (fs_dcachegen) goes
+ * up, so that lookups on it that were already in flight don't put
+ * back what they found. Other filesystems aren't affected.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <fs.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries kept, and of hash chains. */
+#define DCACHE_SIZE	64
+#define DCACHE_HASHSIZE	32
+
+struct dcentry {
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lruprev;	/* LRU list */
+	struct dcentry *dc_lrunext;
+	struct vnode *dc_dir;		/* where the lookup started */
+	char *dc_name;			/* path relative to dc_dir */
+	struct vnode *dc_vn;		/* result, or NULL for ENOENT */
+};
+
+static struct lock *dcache_lock;
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+static unsigned dcache_num;
+static unsigned dcache_devgen;		/* for vnodes not on any fs */
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list (dcache lock held)
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir / sizeof(struct vnode);
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	for (dc = dcache_hash[dcache_hashfn(dir, name)];
+	     dc != NULL; dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lruprev = dc->dc_lrunext = NULL;
+}
+
+static
+void
+dcache_lru_append(struct dcentry *dc)
+{
+	dc->dc_lruprev = dcache_lrutail;
+	dc->dc_lrunext = NULL;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = dc;
+	}
+	else {
+		dcache_lruhead = dc;
+	}
+	dcache_lrutail = dc;
+}
+
+static
+void
+dcache_link(struct dcentry *dc)
+{
+	unsigned h = dcache_hashfn(dc->dc_dir, dc->dc_name);
+
+	dc->dc_hashnext = dcache_hash[h];
+	dcache_hash[h] = dc;
+	dcache_lru_append(dc);
+	dcache_num++;
+}
+
+/*
+ * Take an entry out of the cache. It goes on the DEAD list (linked
+ * through dc_hashnext) to be freed once the lock is released, since
+ * dropping the vnode references may call VOP_RECLAIM.
+ */
+static
+void
+dcache_unlink(struct dcentry *dc, struct dcentry **dead)
+{
+	struct dcentry **dcp;
+
+	dcp = &dcache_hash[dcache_hashfn(dc->dc_dir, dc->dc_name)];
+	while (*dcp != dc) {
+		KASSERT(*dcp != NULL);
+		dcp = &(*dcp)->dc_hashnext;
+	}
+	*dcp = dc->dc_hashnext;
+	dcache_lru_remove(dc);
+	KASSERT(dcache_num > 0);
+	dcache_num--;
+
+	dc->dc_hashnext = *dead;
+	*dead = dc;
+}
+
+/*
+ * Free entries collected by dcache_unlink. Lock not held.
+ */
+static
+void
+dcache_freelist(struct dcentry *dead)
+{
+	struct dcentry *dc;
+
+	while (dead != NULL) {
+		dc = dead;
+		dead = dc->dc_hashnext;
+
+		if (dc->dc_vn != NULL) {
+			VOP_DECREF(dc->dc_vn);
+		}
+		VOP_DECREF(dc->dc_dir);
+		kfree(dc->dc_name);
+		kfree(dc);
+	}
+}
+
+/*
+ * Generation number for entries whose directory is on FS.
+ */
+static
+unsigned *
+dcache_genp(struct fs *fs)
+{
+	return fs != NULL ? &fs->fs_dcachegen : &dcache_devgen;
+}
+
+/*
+ * Drop the entries for FS, or only the negative ones.
+ */
+static
+void
+dcache_invalidate(struct fs *fs, bool negonly)
+{
+	struct dcentry *dc, *next;
+	struct dcentry *dead = NULL;
+
+	lock_acquire(dcache_lock);
+	(*dcache_genp(fs))++;
+	for (dc = dcache_lruhead; dc != NULL; dc = next) {
+		next = dc->dc_lrunext;
+		if (dc->dc_dir->vn_fs == fs &&
+		    (!negonly || dc->dc_vn == NULL)) {
+			dcache_unlink(dc, &dead);
+		}
+	}
+	lock_release(dcache_lock);
+
+	dcache_freelist(dead);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_lock = lock_create("vfs_dcache");
+	if (dcache_lock == NULL) {
+		panic("vfs: Could not create dcache lock\n");
+	}
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	dcache_num = 0;
+	dcache_devgen = 0;
+}
+
+/*
+ * Look up NAME relative to DIR. Returns false on a miss; otherwise
+ * true, with a new reference to the vnode in *RET, or NULL in *RET
+ * if the name is known not to exist.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+
+	lock_acquire(dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		lock_release(dcache_lock);
+		return false;
+	}
+	dcache_lru_remove(dc);
+	dcache_lru_append(dc);
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+	}
+	*ret = dc->dc_vn;
+	lock_release(dcache_lock);
+	return true;
+}
+
+/*
+ * Return the current generation number of DIR's filesystem, to be
+ * passed to vfs_dcache_enter once the lookup is done.
+ */
+unsigned
+vfs_dcache_getgen(struct vnode *dir)
+{
+	unsigned gen;
+
+	lock_acquire(dcache_lock);
+	gen = *dcache_genp(dir->vn_fs);
+	lock_release(dcache_lock);
+	return gen;
+}
+
+/*
+ * Remember that looking up NAME relative to DIR gave VN (NULL for
+ * ENOENT), unless DIR's filesystem has been invalidated since GEN.
+ * Failure to allocate just means the result isn't cached.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *dc;
+	struct dcentry *dead = NULL;
+
+	dc = kmalloc(sizeof(*dc));
+	if (dc == NULL) {
+		return;
+	}
+	dc->dc_name = kstrdup(name);
+	if (dc->dc_name == NULL) {
+		kfree(dc);
+		return;
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+
+	lock_acquire(dcache_lock);
+	if (gen != *dcache_genp(dir->vn_fs) ||
+	    dcache_find(dir, name) != NULL) {
+		/* stale, or someone else got there first */
+		lock_release(dcache_lock);
+		kfree(dc->dc_name);
+		kfree(dc);
+		return;
+	}
+
+	/* Make room */
+	while (dcache_num >= DCACHE_SIZE) {
+		dcache_unlink(dcache_lruhead, &dead);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dcache_link(dc);
+	lock_release(dcache_lock);
+
+	dcache_freelist(dead);
+}
+
+/*
+ * Drop every entry for filesystem FS, because a name on it was
+ * removed or renamed, or it is being unmounted.
+ */
+void
+vfs_dcache_invalidate(struct fs *fs)
+{
+	dcache_invalidate(fs, false);
+}
+
+/*
+ * Drop the negative entries for FS, because a name was created on it.
+ * Names that were found are still there.
+ */
+void
+vfs_dcache_invalidate_negative(struct fs *fs)
+{
+	dcache_invalidate(fs, true);
+}
@@ -0,0 +1,85 @@
+/*
+ * Support for vop_getdirentries: packing struct dirent records into
+ * a uio, and a version of the operation built on vop_getdirentry for
+ * filesystems that only know names.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/dirent.h>
+#include <lib.h>
+#include <limits.h>
+#include <uio.h>
+#include <vnode.h>
+
+/*
+ * Append a record for NAME to UIO. Returns ENOSPC, without touching
+ * UIO, if there isn't room for the whole record.
+ */
+int
+vfs_dirent_emit(struct uio *uio, uint32_t ino, unsigned type,
+		const char *name)
+{
+	struct dirent d;
+	size_t namlen, reclen;
+
+	namlen = strlen(name);
+	KASSERT(namlen <= NAME_MAX);
+	reclen = DIRENT_RECLEN(namlen);
+	if (reclen > uio->uio_resid) {
+		return ENOSPC;
+	}
+
+	d.d_ino = ino;
+	d.d_reclen = reclen;
+	d.d_type = type;
+	d.d_namlen = namlen;
+	/* zero the padding too, so no kernel stack goes out with it */
+	bzero(d.d_name, reclen - DIRENT_HDRSIZE);
+	memcpy(d.d_name, name, namlen);
+
+	return uiomove(&d, reclen, uio);
+}
+
+/*
+ * vop_getdirentries in terms of vop_getdirentry: one name at a time,
+ * with no inode number or type. The cookie is the one vop_getdirentry
+ * uses.
+ */
+int
+vfs_getdirentries_byname(struct vnode *dir, struct uio *uio)
+{
+	char name[NAME_MAX + 1];
+	struct iovec iov;
+	struct uio ku;
+	size_t startresid = uio->uio_resid;
+	off_t pos = uio->uio_offset;
+	int result;
+
+	while (1) {
+		uio_kinit(&iov, &ku, name, NAME_MAX, pos, UIO_READ);
+		result = VOP_GETDIRENTRY(dir, &ku);
+		if (result) {
+			break;
+		}
+		if (ku.uio_resid == NAME_MAX) {
+			/* end of directory */
+			break;
+		}
+		name[NAME_MAX - ku.uio_resid] = 0;
+
+		result = vfs_dirent_emit(uio, 0, DT_UNKNOWN, name);
+		if (result == ENOSPC) {
+			/* full; it's only an error if nothing fit */
+			result = uio->uio_resid == startresid ? EINVAL : 0;
+			break;
+		}
+		if (result) {
+			break;
+		}
+		pos = ku.uio_offset;
+	}
+
+	uio->uio_offset = pos;
+	return result;
+}
@@ -45,7 +45,7 @@
  */
 
 ////////////////////////////////////////////////////////////
-// uio ops (read, readlink, getdirentry, write, namefile)
+// uio ops (read, readlink, getdirentry, getdirentries, write, namefile)
 
 int
 vopfail_uio_notdir(struct vnode *vn, struct uio *uio)
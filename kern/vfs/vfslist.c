@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -112,6 +113,9 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	bio_bootstrap();
+	buffer_bootstrap();
+	vfs_dcache_bootstrap();
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -433,6 +437,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_fs = fs;
 
 	if (fs!=NULL) {
+		fs->fs_dcachegen = 0;
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
@@ -565,6 +570,7 @@ vfs_mount(const char *devname, void *data,
 	KASSERT(fs != NULL);
 	KASSERT(fs != SWAP_FS); 
 
+	fs->fs_dcachegen = 0;
 	kd->kd_fs = fs;
 
 	volname = FSOP_GETVOLNAME(fs);
@@ -652,6 +658,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* let go of the vnodes the lookup cache holds */
+	vfs_dcache_invalidate(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -743,6 +752,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_dcache_invalidate(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
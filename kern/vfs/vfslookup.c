@@ -254,6 +254,12 @@ vfs_lookparent(char *path, struct vnode **retval,
 		return result;
 	}
 
+	/*
+	 * The biglock only protects the device and bootfs tables;
+	 * the filesystem does its own locking from here on.
+	 */
+	vfs_biglock_release();
+
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -268,7 +274,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -276,6 +281,8 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char *name;
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
@@ -286,15 +293,30 @@ vfs_lookup(char *path, struct vnode **retval)
 		return result;
 	}
 
+	/* As above, the filesystem does its own locking. */
+	vfs_biglock_release();
+
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	if (vfs_dcache_lookup(startvn, path, retval)) {
+		VOP_DECREF(startvn);
+		return *retval == NULL ? ENOENT : 0;
+	}
+
+	/* VOP_LOOKUP may destroy the path, so keep a copy for the cache */
+	gen = vfs_dcache_getgen(startvn);
+	name = kstrdup(path);
+
 	result = VOP_LOOKUP(startvn, path, retval);
 
+	if (name != NULL && (result == 0 || result == ENOENT)) {
+		vfs_dcache_enter(startvn, name, result ? NULL : *retval, gen);
+	}
+	kfree(name);
+
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
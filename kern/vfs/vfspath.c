@@ -75,6 +75,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
 
+		/* The name may not have existed before */
+		vfs_dcache_invalidate_negative(dir->vn_fs);
+
 		VOP_DECREF(dir);
 	}
 	else {
@@ -146,6 +149,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_dcache_invalidate(dir->vn_fs);
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +183,7 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_dcache_invalidate(olddir->vn_fs);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +218,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_dcache_invalidate_negative(newdir->vn_fs);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +246,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_dcache_invalidate_negative(newdir->vn_fs);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +293,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_dcache_invalidate_negative(parent->vn_fs);
 
 	VOP_DECREF(parent);
 
@@ -308,6 +316,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_dcache_invalidate(parent->vn_fs);
 
 	VOP_DECREF(parent);
 
@@ -146,6 +146,7 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -174,80 +175,141 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page begins with a small header (struct kheap_root)
+ * that holds its list linkage and the bitmap of free entries; the
+ * rest of the page holds pagerefs. With 4K pages that is a bit over
+ * 200 pagerefs, which can manage about 800K of kernel heap.
+ *
+ * Pageref pages are allocated on demand and given back when they
+ * become empty, so the subpage heap is limited only by the amount of
+ * RAM. Since the header is at the start of the page, the root for
+ * any pageref can be found by masking its address.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define MAX_INUSE_WORDS DIVROUNDUP(PAGE_SIZE / sizeof(struct pageref), 32)
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
+struct kheap_root {
+	struct kheap_root *next;
+	struct kheap_root *prev;
+	unsigned numinuse;
+	uint32_t pagerefs_inuse[MAX_INUSE_WORDS];
 };
 
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(struct kheap_root)) / sizeof(struct pageref))
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS_PER_PAGE, 32)
 
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
+struct pagerefpage {
+	struct kheap_root root;
+	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
+#define PR_ROOT(pr) \
+	(&((struct pagerefpage *)((vaddr_t)(pr) & PAGE_FRAME))->root)
+
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * List of all pageref pages. Pages that have free entries are kept
+ * at the front and full pages at the back, so if the first page is
+ * full, they all are.
  */
+static struct kheap_root *kheaproots;
+static struct kheap_root *kheaproots_tail;
+static unsigned numpagerefpages;
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+static
+void
+root_unlink(struct kheap_root *root)
+{
+	if (root->prev != NULL) {
+		root->prev->next = root->next;
+	}
+	else {
+		KASSERT(kheaproots == root);
+		kheaproots = root->next;
+	}
+	if (root->next != NULL) {
+		root->next->prev = root->prev;
+	}
+	else {
+		KASSERT(kheaproots_tail == root);
+		kheaproots_tail = root->prev;
+	}
+	root->next = root->prev = NULL;
+}
+
+static
+void
+root_addhead(struct kheap_root *root)
+{
+	root->prev = NULL;
+	root->next = kheaproots;
+	if (kheaproots != NULL) {
+		kheaproots->prev = root;
+	}
+	else {
+		kheaproots_tail = root;
+	}
+	kheaproots = root;
+}
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static
+void
+root_addtail(struct kheap_root *root)
+{
+	root->next = NULL;
+	root->prev = kheaproots_tail;
+	if (kheaproots_tail != NULL) {
+		kheaproots_tail->next = root;
+	}
+	else {
+		kheaproots = root;
+	}
+	kheaproots_tail = root;
+}
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page to hold pagerefs and put it at the front of the
+ * list.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+struct kheap_root *
+allocpagerefpage(void)
 {
+	struct kheap_root *root;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
+	COMPILE_ASSERT(INUSE_WORDS <= MAX_INUSE_WORDS);
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * Note that this means things can change behind our back;
+	 * but since we only ever add the new page, that's harmless.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return NULL;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	root = &((struct pagerefpage *)va)->root;
+	root->numinuse = 0;
+	for (i=0; i<MAX_INUSE_WORDS; i++) {
+		root->pagerefs_inuse[i] = 0;
+	}
+	/* Mark the nonexistent entries past the end as in use. */
+	for (i=NPAGEREFS_PER_PAGE; i<INUSE_WORDS*32; i++) {
+		root->pagerefs_inuse[i/32] |= ((uint32_t)1) << (i%32);
 	}
 
-	root->page = (struct pagerefpage *)va;
+	root_addhead(root);
+	numpagerefpages++;
+	return root;
 }
 
 /*
@@ -259,92 +321,110 @@ allocpageref(void)
 {
 	unsigned i,j;
 	uint32_t k;
-	unsigned whichroot;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
+	root = kheaproots;
+	if (root == NULL || root->numinuse >= NPAGEREFS_PER_PAGE) {
+		root = allocpagerefpage();
+		if (root == NULL) {
+			return NULL;
 		}
+	}
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
+	for (i=0; i<INUSE_WORDS; i++) {
+		if (root->pagerefs_inuse[i]==0xffffffff) {
+			/* full */
+			continue;
+		}
+		for (k=1,j=0; k!=0; k<<=1,j++) {
+			if ((root->pagerefs_inuse[i] & k)==0) {
+				root->pagerefs_inuse[i] |= k;
+				root->numinuse++;
+				if (root->numinuse == NPAGEREFS_PER_PAGE) {
+					/* now full; move it out of the way */
+					root_unlink(root);
+					root_addtail(root);
 				}
+				return &((struct pagerefpage *)root)->refs[i*32 + j];
 			}
-			KASSERT(0);
 		}
+		KASSERT(0);
 	}
 
-	/* ran out */
+	/* numinuse said there was a free entry */
+	panic("kmalloc: pageref page %p has no free entries\n", root);
 	return NULL;
 }
 
 /*
- * Release a pageref structure.
+ * Release a pageref structure. If this leaves its page empty and
+ * some other page still has free entries, the page is taken off the
+ * list and its address is returned so the caller can hand it back
+ * with free_kpages once kmalloc_spinlock is released. Otherwise
+ * returns 0.
  */
 static
-void
+vaddr_t
 freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+	root = PR_ROOT(p);
+	page = (struct pagerefpage *)root;
+
+	j = p-page->refs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((root->pagerefs_inuse[i] & k) != 0);
+	root->pagerefs_inuse[i] &= ~k;
+	KASSERT(root->numinuse > 0);
+	if (root->numinuse == NPAGEREFS_PER_PAGE) {
+		/* no longer full; move it back to the front */
+		root_unlink(root);
+		root_addhead(root);
+	}
+	root->numinuse--;
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	if (root->numinuse > 0) {
+		return 0;
+	}
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	/*
+	 * Keep one page with free entries around so a workload that
+	 * repeatedly allocates and frees one heap page doesn't also
+	 * churn the pageref page.
+	 */
+	if (kheaproots == root && (root->next == NULL ||
+		root->next->numinuse >= NPAGEREFS_PER_PAGE)) {
+		return 0;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+
+	root_unlink(root);
+	KASSERT(numpagerefpages > 0);
+	numpagerefpages--;
+	return (vaddr_t)page;
 }
 
 ////////////////////////////////////////
 
 /*
  * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * that same size, and one of all blocks. It is also on a hash chain
+ * keyed by its page address, so kfree can find it without walking
+ * the list of all blocks.
  */
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+#define PRHASH_SIZE 256
+#define PRHASH(va) (((va) / PAGE_SIZE) % PRHASH_SIZE)
+static struct pageref *prhash[PRHASH_SIZE];
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -588,14 +668,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < numpagerefpages * NPAGEREFS_PER_PAGE);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < numpagerefpages * NPAGEREFS_PER_PAGE);
 		ac++;
 	}
 
@@ -817,7 +897,7 @@ kheap_printstats(void)
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Remove a pageref from all the lists that it's on.
  */
 static
 void
@@ -842,6 +922,14 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+
+	guy = &prhash[PRHASH(PR_PAGEADDR(pr))];
+	for (; *guy; guy = &(*guy)->next_hash) {
+		if (*guy == pr) {
+			*guy = pr->next_hash;
+			break;
+		}
+	}
 }
 
 /*
@@ -1013,6 +1101,9 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pr->next_hash = prhash[PRHASH(prpage)];
+	prhash[PRHASH(prpage)] = pr;
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -1032,6 +1123,7 @@ subpage_kfree(void *ptr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t refpage;	// pageref page to release, if any
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1069,7 +1161,7 @@ subpage_kfree(void *ptr)
 	prpage = 0;
 	blktype = 0;
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (pr = prhash[PRHASH(ptraddr)]; pr; pr = pr->next_hash) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 		KASSERT(blktype >= 0 && blktype < NSIZES);
@@ -1141,10 +1233,13 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
-		freepageref(pr);
+		refpage = freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
+		if (refpage != 0) {
+			free_kpages(refpage);
+		}
 	}
 	else {
 		spinlock_release(&kmalloc_spinlock);